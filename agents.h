@@ -0,0 +1,141 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "distance_field.h"
+#include "occupancy.h"
+#include "ray_packet.h"
+#include "texture.h"
+#include "thread_pool.h"
+
+// where AgentBatch::cast writes: arrays owned by the caller, one block per
+// agent, agent after agent ([agent][column]). a null pointer skips that
+// output
+struct AgentOutputs {
+  float *dis = nullptr;        // unit: grid, the view distance for a miss
+  int32_t *material = nullptr; // the wall's palette index, 0: no hit
+  // the columns as FPV draws them, rows pixels each from top to bottom, 3
+  // bytes (r, g, b) per pixel: [agent][column][row][3]
+  uint8_t *rgb = nullptr;
+  size_t rows = 0;
+};
+
+// the views of many agents over one map at once, e.g. the observations of a
+// training step: positions and angles in, per-column distances, materials
+// and pixels out. the agents share the map and its acceleration structures
+// (the field first, then the pyramid, as LocalMiniMap), the directions of
+// the view and the thread pool; there is no Player or Window per agent
+class AgentBatch {
+public:
+  const OccupancyPyramid *pyramid = nullptr;
+  const DistanceField *field = nullptr;
+  const TextureAtlas *textures = nullptr; // see FPV::textures
+  float max_dis = 20;                     // unit: grid, as Player::view_dis
+  uint32_t ceiling_color = 0xFF000000;
+  uint32_t floor_color = 0xFF000000;
+
+  // palette: the wall colors, indexed by material
+  AgentBatch(const PacketGrid &grid, const uint32_t *palette)
+      : grid(grid), palette(palette) {}
+
+  // n agents, agent k at (x[k], y[k]) with its first ray at angle a[k]
+  // (like Player::a), all of them seeing fov over `columns` rays
+  void cast(size_t n, const float *x, const float *y, const float *a,
+            float fov, size_t columns, const AgentOutputs &out,
+            Projection projection = Projection::Angular) {
+    if (!columns)
+      return;
+    view.set(fov, columns, projection);
+    // tiles of a few hundred rays, whole agents
+    size_t grain = std::max<size_t>(1, 256 / columns);
+    ThreadPool::shared().parallel_for(
+        0, n, grain, [&](size_t begin, size_t end) {
+          RayPacket &packet = scratch();
+          for (size_t k = begin; k < end; k++) {
+            packet.set_view(view, a[k]);
+            cast_agent(x[k], y[k], packet);
+            store(k, x[k], y[k], packet, out);
+          }
+        });
+  }
+
+private:
+  PacketGrid grid;
+  const uint32_t *palette;
+  ViewTable view;
+
+  // the rays of the agents a thread is working on, one agent at a time;
+  // kept for the next tile and the next call
+  static RayPacket &scratch() {
+    static thread_local RayPacket packet;
+    return packet;
+  }
+
+  void cast_agent(float x, float y, RayPacket &p) const {
+    if (field)
+      cast_packet(*field, grid.cells, x, y, p, palette, 0, p.size(), max_dis);
+    else if (pyramid)
+      cast_packet(*pyramid, grid.cells, x, y, p, palette, 0, p.size(),
+                  max_dis);
+    else
+      cast_packet(grid.cells, grid, x, y, p, palette, max_dis);
+  }
+
+  static void put(uint8_t *pixel, uint32_t color) {
+    pixel[0] = uint8_t(color);
+    pixel[1] = uint8_t(color >> 8);
+    pixel[2] = uint8_t(color >> 16);
+  }
+  // n pixels of one color, four (12 bytes) at a time; returns the end
+  static uint8_t *fill(uint8_t *pixel, long n, uint32_t color) {
+    uint8_t pattern[12];
+    for (int j = 0; j < 4; j++)
+      put(pattern + 3 * j, color);
+    for (; n >= 4; n -= 4, pixel += 12)
+      memcpy(pixel, pattern, 12);
+    for (; n > 0; n--, pixel += 3)
+      put(pixel, color);
+    return pixel;
+  }
+
+  void store(size_t k, float x, float y, const RayPacket &p,
+             const AgentOutputs &out) const {
+    const size_t columns = p.size();
+    if (out.dis)
+      std::copy(p.dis.begin(), p.dis.end(), out.dis + k * columns);
+    if (out.material)
+      std::copy(p.material.begin(), p.material.end(),
+                out.material + k * columns);
+    if (!out.rgb || !out.rows)
+      return;
+    const long rows = long(out.rows);
+    uint8_t *pixel = out.rgb + k * columns * out.rows * 3;
+    for (size_t i = 0; i < columns; i++) {
+      // the slice of FPV::draw_FPV; an agent inside a wall sees only wall
+      float dis = std::max(p.dis[i], 1e-6f);
+      long wall_top = long(float(rows) / 2.0 * (1.0 - 1.0 / dis));
+      long wall_bottom = wall_top + long(float(rows) / dis);
+      long top = std::max(0L, std::min(wall_top, rows));
+      long bottom = std::max(top, std::min(wall_bottom, rows));
+      pixel = fill(pixel, top, ceiling_color);
+      int32_t material = p.material[i];
+      if (top < bottom && textures && material > 0 &&
+          size_t(material) < textures->count()) {
+        size_t n = textures->size();
+        float u = wall_u(x, y, p.dir_x[i], p.dir_y[i], p.dis[i],
+                         WallSide(p.side[i]));
+        const uint32_t *strip =
+            textures->column(material, std::min(size_t(u * n), n - 1));
+        // the texel rows of Window::draw_textured_column
+        uint64_t step = (uint64_t(n) << 32) / uint64_t(wall_bottom - wall_top);
+        for (long r = top; r < bottom; r++, pixel += 3)
+          put(pixel, strip[uint64_t(r - wall_top) * step >> 32]);
+      } else {
+        pixel = fill(pixel, bottom - top, p.color[i]);
+      }
+      pixel = fill(pixel, rows - bottom, floor_color);
+    }
+  }
+};
@@ -0,0 +1,172 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "simd.h"
+
+// how a color goes over the pixel that is already there. pixels are
+// 0xAABBGGRR with straight (not premultiplied) alpha; a is the source's:
+//   Copy:       s, alpha and all
+//   SourceOver: s * a + d * (1 - a), alpha a + da * (1 - a)
+//   Additive:   d + s * a, saturated at 255; alpha da + a
+//   Multiply:   d * (s * a + (1 - a)): a darkening tint, alpha da
+// channels are 8 bits, x / 255 rounds to nearest. every path gives the
+// same bytes
+enum class BlendMode : uint8_t { Copy, SourceOver, Additive, Multiply };
+
+namespace blend_detail {
+
+inline uint32_t div255(uint32_t x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+inline uint32_t blend_pixel(uint32_t d, uint32_t s, BlendMode mode) {
+  uint32_t a = s >> 24, out = 0;
+  s |= 0xFF000000; // as its own weight, the source's alpha counts as 1
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t dc = (d >> shift) & 255, sc = (s >> shift) & 255, c;
+    if (mode == BlendMode::SourceOver)
+      c = div255(sc * a + dc * (255 - a));
+    else if (mode == BlendMode::Additive)
+      c = std::min<uint32_t>(255, dc + div255(sc * a));
+    else
+      c = div255((255 - div255((255 - sc) * a)) * dc);
+    out |= c << shift;
+  }
+  return out;
+}
+
+// Solid: src is one color, not a span
+template <bool Solid>
+void blend_scalar(uint32_t *dst, const uint32_t *src, size_t n,
+                  BlendMode mode) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = blend_pixel(dst[i], src[Solid ? 0 : i], mode);
+}
+
+#if TRC_X86_SIMD
+// two pixels (or four, in the avx2 version) a register as 16-bit channels:
+// the products fit, 255 * 255 + 128 < 65536, and so does div255's sum
+TRC_TARGET("sse4.1")
+inline __m128i div255_sse(__m128i x) {
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+TRC_TARGET("sse4.1")
+inline __m128i blend_sse(__m128i d, __m128i s, BlendMode mode) {
+  const __m128i full = _mm_set1_epi16(255);
+  __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+  s = _mm_or_si128(s, _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255));
+  if (mode == BlendMode::SourceOver)
+    return div255_sse(_mm_add_epi16(_mm_mullo_epi16(s, a),
+                                    _mm_mullo_epi16(d, _mm_sub_epi16(full, a))));
+  if (mode == BlendMode::Additive)
+    return _mm_add_epi16(d, div255_sse(_mm_mullo_epi16(s, a)));
+  __m128i tint = _mm_sub_epi16(
+      full, div255_sse(_mm_mullo_epi16(_mm_sub_epi16(full, s), a)));
+  return div255_sse(_mm_mullo_epi16(tint, d));
+}
+
+// 8 pixels an iteration, 4 a load; returns how many were done
+template <bool Solid>
+TRC_TARGET("sse4.1")
+size_t blend_sse41(uint32_t *dst, const uint32_t *src, size_t n,
+                   BlendMode mode) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i solid = _mm_set1_epi32(int(src[0]));
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    for (size_t k = i; k < i + 8; k += 4) {
+      __m128i d = _mm_loadu_si128((const __m128i *)(dst + k));
+      __m128i s =
+          Solid ? solid : _mm_loadu_si128((const __m128i *)(src + k));
+      __m128i lo = blend_sse(_mm_unpacklo_epi8(d, zero),
+                             _mm_unpacklo_epi8(s, zero), mode);
+      __m128i hi = blend_sse(_mm_unpackhi_epi8(d, zero),
+                             _mm_unpackhi_epi8(s, zero), mode);
+      _mm_storeu_si128((__m128i *)(dst + k), _mm_packus_epi16(lo, hi));
+    }
+  return i;
+}
+
+TRC_TARGET("avx2")
+inline __m256i div255_avx2(__m256i x) {
+  x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+TRC_TARGET("avx2")
+inline __m256i blend_avx2(__m256i d, __m256i s, BlendMode mode) {
+  const __m256i full = _mm256_set1_epi16(255);
+  __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF);
+  s = _mm256_or_si256(s, _mm256_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255, //
+                                           0, 0, 0, 255, 0, 0, 0, 255));
+  if (mode == BlendMode::SourceOver)
+    return div255_avx2(
+        _mm256_add_epi16(_mm256_mullo_epi16(s, a),
+                         _mm256_mullo_epi16(d, _mm256_sub_epi16(full, a))));
+  if (mode == BlendMode::Additive)
+    return _mm256_add_epi16(d, div255_avx2(_mm256_mullo_epi16(s, a)));
+  __m256i tint = _mm256_sub_epi16(
+      full, div255_avx2(_mm256_mullo_epi16(_mm256_sub_epi16(full, s), a)));
+  return div255_avx2(_mm256_mullo_epi16(tint, d));
+}
+
+// 16 pixels an iteration, 8 a load. unpack and pack work inside each
+// 128-bit half, so the pixels come out where they went in
+template <bool Solid>
+TRC_TARGET("avx2")
+size_t blend_avx2_span(uint32_t *dst, const uint32_t *src, size_t n,
+                       BlendMode mode) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i solid = _mm256_set1_epi32(int(src[0]));
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+    for (size_t k = i; k < i + 16; k += 8) {
+      __m256i d = _mm256_loadu_si256((const __m256i *)(dst + k));
+      __m256i s =
+          Solid ? solid : _mm256_loadu_si256((const __m256i *)(src + k));
+      __m256i lo = blend_avx2(_mm256_unpacklo_epi8(d, zero),
+                              _mm256_unpacklo_epi8(s, zero), mode);
+      __m256i hi = blend_avx2(_mm256_unpackhi_epi8(d, zero),
+                              _mm256_unpackhi_epi8(s, zero), mode);
+      _mm256_storeu_si256((__m256i *)(dst + k), _mm256_packus_epi16(lo, hi));
+    }
+  return i;
+}
+#endif
+
+template <bool Solid>
+void blend(uint32_t *dst, const uint32_t *src, size_t n, BlendMode mode,
+           SimdLevel level) {
+  if (mode == BlendMode::Copy) {
+    if (Solid)
+      std::fill_n(dst, n, src[0]);
+    else
+      memmove(dst, src, n * sizeof(uint32_t));
+    return;
+  }
+  size_t done = 0;
+#if TRC_X86_SIMD
+  if (level == SimdLevel::AVX2)
+    done = blend_avx2_span<Solid>(dst, src, n, mode);
+  else if (level == SimdLevel::SSE41)
+    done = blend_sse41<Solid>(dst, src, n, mode);
+#endif
+  blend_scalar<Solid>(dst + done, src + (Solid ? 0 : done), n - done, mode);
+}
+
+} // namespace blend_detail
+
+// the n pixels of src over the n pixels of dst
+inline void blend_span(uint32_t *dst, const uint32_t *src, size_t n,
+                       BlendMode mode, SimdLevel level = simd_level()) {
+  blend_detail::blend<false>(dst, src, n, mode, level);
+}
+// color over the n pixels of dst
+inline void blend_fill(uint32_t *dst, uint32_t color, size_t n,
+                       BlendMode mode, SimdLevel level = simd_level()) {
+  blend_detail::blend<true>(dst, &color, n, mode, level);
+}
@@ -0,0 +1,201 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ray_packet.h"
+#include "raycast.h"
+#include "thread_pool.h"
+
+// for every cell, the chessboard distance to the nearest wall: 0 for a wall,
+// n when all cells fewer than n steps away (in x and y) are empty, capped at
+// 255. a ray in a cell with distance n stands in an empty square of
+// 2n - 1 cells around it and leaves that square in one step; on maps with
+// sparse, irregular walls that beats fixed blocks (OccupancyPyramid), which
+// a single wall anywhere in them spoils
+class DistanceField {
+public:
+  enum : uint8_t { far = 255 };
+
+  DistanceField() {}
+  // builds the field in parallel: columns, then rows
+  DistanceField(const char *matrix, size_t w, size_t h)
+      : w(w), h(h), dis(w * h) {
+    ThreadPool &pool = ThreadPool::shared();
+    // the distance to the nearest wall in the same column, as a sweep down
+    // and one up over bands of columns (whole rows of a band at a time so
+    // the reads stay sequential)
+    pool.parallel_for(0, w, 256, [&](size_t x0, size_t x1) {
+      for (size_t x = x0; x < x1; x++)
+        dis[x] = matrix[x] != '0' ? 0 : far;
+      for (size_t y = 1; y < h; y++)
+        for (size_t x = x0; x < x1; x++)
+          dis[x + y * w] = matrix[x + y * w] != '0'
+                               ? 0
+                               : std::min<int>(far, dis[x + (y - 1) * w] + 1);
+      for (size_t y = h - 1; y-- > 0;)
+        for (size_t x = x0; x < x1; x++)
+          dis[x + y * w] =
+              std::min<int>(dis[x + y * w], dis[x + (y + 1) * w] + 1);
+    });
+    // then per row: min over columns i of max(|x - i|, column distance i).
+    // capping the column distances at far first changes nothing below far
+    pool.parallel_for(0, h, 16, [&](size_t y0, size_t y1) {
+      std::vector<int> g(w), s(w), t(w);
+      for (size_t y = y0; y < y1; y++)
+        chessboard_row(&dis[y * w], g.data(), s.data(), t.data());
+    });
+  }
+
+  size_t grid_w() const { return w; }
+  size_t grid_h() const { return h; }
+  uint8_t at(size_t x, size_t y) const { return dis[x + y * w]; }
+  const std::vector<uint8_t> &data() const { return dis; }
+
+  // one step of a traversal from an empty cell: out of the empty square
+  // around it, or a single cell next to a wall
+  float advance(raycast_detail::Dda &dda, WallSide &side) const {
+    int n = dis[dda.map_x + dda.map_y * w];
+    if (n <= 1)
+      return dda.step(side);
+    int x0 = std::max(0, dda.map_x - n + 1);
+    int y0 = std::max(0, dda.map_y - n + 1);
+    int x1 = std::min(int(w), dda.map_x + n);
+    int y1 = std::min(int(h), dda.map_y + n);
+    return dda.skip_box(x0, y0, x1, y1, side);
+  }
+
+  // a field saved next to a map: "TRCD", version, w, h and a hash of the
+  // cells it was built from, then one byte per cell
+  bool save(const std::string &path, const char *matrix) const {
+    std::ofstream out(path, std::ios::binary);
+    CacheHeader header = {{'T', 'R', 'C', 'D'}, 1, w, h, hash(matrix, w * h)};
+    out.write((const char *)&header, sizeof(header));
+    out.write((const char *)dis.data(), dis.size());
+    return bool(out.flush());
+  }
+  // false when the file is missing or was built from other cells
+  bool load(const std::string &path, const char *matrix, size_t w, size_t h) {
+    std::ifstream in(path, std::ios::binary);
+    CacheHeader header;
+    if (!in.read((char *)&header, sizeof(header)) ||
+        memcmp(header.magic, "TRCD", 4) != 0 || header.version != 1 ||
+        header.w != w || header.h != h ||
+        header.map_hash != hash(matrix, w * h))
+      return false;
+    std::vector<uint8_t> loaded(w * h);
+    if (!in.read((char *)loaded.data(), loaded.size()))
+      return false;
+    this->w = w;
+    this->h = h;
+    dis.swap(loaded);
+    return true;
+  }
+  // the field cached at path, built and written there if the cache is
+  // missing or stale (a failed write only costs the next start a rebuild)
+  static DistanceField cached(const std::string &path, const char *matrix,
+                              size_t w, size_t h) {
+    DistanceField field;
+    if (!field.load(path, matrix, w, h)) {
+      field = DistanceField(matrix, w, h);
+      field.save(path, matrix);
+    }
+    return field;
+  }
+
+private:
+  struct CacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t w;
+    uint64_t h;
+    uint64_t map_hash;
+  };
+
+  size_t w = 0;
+  size_t h = 0;
+  std::vector<uint8_t> dis;
+
+  // FNV-1a over 8-byte words
+  static uint64_t hash(const char *matrix, size_t n) {
+    uint64_t hv = 14695981039346656037ull;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      uint64_t word;
+      memcpy(&word, matrix + i, 8);
+      hv = (hv ^ word) * 1099511628211ull;
+    }
+    for (; i < n; i++)
+      hv = (hv ^ uint8_t(matrix[i])) * 1099511628211ull;
+    return hv;
+  }
+
+  // the lower envelope of the cones max(|x - i|, g(i)) in one pass each way
+  // (Meijster, Roerdink and Hesselink's distance transform, chessboard
+  // metric). row: column distances in, chessboard distances out
+  void chessboard_row(uint8_t *row, int *g, int *s, int *t) const {
+    const int n = int(w);
+    for (int i = 0; i < n; i++)
+      g[i] = row[i];
+    auto f = [&](int x, int i) { return std::max(std::abs(x - i), g[i]); };
+    auto sep = [&](int i, int u) {
+      return g[i] <= g[u] ? std::max(i + g[u], (i + u) / 2)
+                          : std::min(u - g[i], (i + u) / 2);
+    };
+    int q = 0;
+    s[0] = 0;
+    t[0] = 0;
+    for (int u = 1; u < n; u++) {
+      while (q >= 0 && f(t[q], s[q]) > f(t[q], u))
+        q--;
+      if (q < 0) {
+        q = 0;
+        s[0] = u;
+      } else {
+        int wu = 1 + sep(s[q], u);
+        if (wu < n) {
+          q++;
+          s[q] = u;
+          t[q] = wu;
+        }
+      }
+    }
+    for (int u = n - 1; u >= 0; u--) {
+      row[u] = uint8_t(std::min<int>(far, f(u, s[q])));
+      if (u == t[q])
+        q--;
+    }
+  }
+};
+
+// cast_ray_dir stepping over empty space with the field. the same hits, bit
+// for bit; the field must be built from matrix
+inline RayHit cast_ray_dir(const DistanceField &field, const char *matrix,
+                           float x, float y, float dir_x, float dir_y,
+                           float max_dis = 20) {
+  return raycast_detail::trace(
+      matrix, field.grid_w(), field.grid_h(), x, y, dir_x, dir_y, max_dis,
+      [&](raycast_detail::Dda &dda, WallSide &side) {
+        return field.advance(dda, side);
+      });
+}
+
+inline RayHit cast_ray(const DistanceField &field, const char *matrix, float x,
+                       float y, float angle, float max_dis = 20) {
+  return cast_ray_dir(field, matrix, x, y, std::cos(angle), std::sin(angle),
+                      max_dis);
+}
+
+// cast_packet through the field, one ray at a time
+inline void cast_packet(const DistanceField &field, const char *matrix,
+                        float x, float y, RayPacket &p, const uint32_t *palette,
+                        size_t begin, size_t end, float max_dis = 20) {
+  cast_packet_each(p, palette, begin, end, [&](float dir_x, float dir_y) {
+    return cast_ray_dir(field, matrix, x, y, dir_x, dir_y, max_dis);
+  });
+}
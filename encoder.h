@@ -0,0 +1,353 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "frame_layout.h"
+#include "simd.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TRC_POSIX_IO 1
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#define TRC_POSIX_IO 0
+#endif
+
+// framebuffer -> file. pixels are 0xAABBGGRR, i.e. the bytes R,G,B,A in
+// memory on the (little endian) machines the vector kernels run on, so
+// packed RGB is every pixel minus its fourth byte
+
+namespace encoder_detail {
+
+inline void rgba_to_rgb_scalar(const uint32_t *src, uint8_t *dst, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint32_t c = src[i];
+    dst[3 * i + 0] = (c >> 0) & 255;
+    dst[3 * i + 1] = (c >> 8) & 255;
+    dst[3 * i + 2] = (c >> 16) & 255;
+  }
+}
+
+#if TRC_X86_SIMD
+// 16 pixels in, 48 bytes out per iteration. every store writes 16 bytes of
+// which 12 are kept, so the loop stops while there is slack behind it
+TRC_TARGET("ssse3")
+inline size_t rgba_to_rgb_ssse3(const uint32_t *src, uint8_t *dst, size_t n) {
+  const __m128i drop_alpha =
+      _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  size_t i = 0;
+  for (; i + 18 <= n; i += 16) {
+    for (int k = 0; k < 4; k++) {
+      __m128i px = _mm_loadu_si128((const __m128i *)(src + i + 4 * k));
+      _mm_storeu_si128((__m128i *)(dst + 3 * i + 12 * k),
+                       _mm_shuffle_epi8(px, drop_alpha));
+    }
+  }
+  return i;
+}
+
+// 8 pixels in, 24 bytes out: shuffle inside each 128-bit half, then move
+// the two 12-byte halves next to each other
+TRC_TARGET("avx2")
+inline size_t rgba_to_rgb_avx2(const uint32_t *src, uint8_t *dst, size_t n) {
+  const __m256i drop_alpha = _mm256_setr_epi8(
+      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, //
+      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+  size_t i = 0;
+  for (; i + 32 + 3 <= n; i += 32) {
+    for (int k = 0; k < 4; k++) {
+      __m256i px = _mm256_loadu_si256((const __m256i *)(src + i + 8 * k));
+      px = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(px, drop_alpha),
+                                       compact);
+      _mm256_storeu_si256((__m256i *)(dst + 3 * i + 24 * k), px);
+    }
+  }
+  return i;
+}
+#endif
+
+} // namespace encoder_detail
+
+// packs n pixels into 3n bytes of RGB
+inline void rgba_to_rgb(const uint32_t *src, uint8_t *dst, size_t n,
+                        SimdLevel level = simd_level()) {
+  size_t done = 0;
+#if TRC_X86_SIMD
+  if (level == SimdLevel::AVX2)
+    done = encoder_detail::rgba_to_rgb_avx2(src, dst, n);
+  else if (level == SimdLevel::SSE41) // sse4.1 implies ssse3
+    done = encoder_detail::rgba_to_rgb_ssse3(src, dst, n);
+#endif
+  encoder_detail::rgba_to_rgb_scalar(src + done, dst + 3 * done, n - done);
+}
+
+inline std::string ppm_header(size_t w, size_t h) {
+  return "P6\n" + std::to_string(w) + " " + std::to_string(h) + "\n255\n";
+}
+
+// the size of the whole file, e.g. to size a memory-mapped output
+inline size_t ppm_size(size_t w, size_t h) {
+  return ppm_header(w, h).size() + 3 * w * h;
+}
+
+// encode into caller-owned memory of at least ppm_size(w,h) bytes
+// (typically a memory-mapped file). returns the bytes written
+inline size_t encode_ppm(const uint32_t *buffer, const FrameLayout &layout,
+                         uint8_t *dst) {
+  const size_t w = layout.w, h = layout.h;
+  std::string header = ppm_header(w, h);
+  memcpy(dst, header.data(), header.size());
+  dst += header.size();
+  if (layout.kind == Layout::RowMajor) {
+    rgba_to_rgb(buffer, dst, w * h);
+  } else {
+    std::vector<uint32_t> scratch;
+    const size_t rows = 64;
+    for (size_t y = 0; y < h; y += rows) {
+      size_t y1 = std::min(h, y + rows);
+      rgba_to_rgb(layout.row_major(buffer, y, y1, scratch), dst + 3 * y * w,
+                  (y1 - y) * w);
+    }
+  }
+  return header.size() + 3 * w * h;
+}
+inline size_t encode_ppm(const uint32_t *buffer, size_t w, size_t h,
+                         uint8_t *dst) {
+  return encode_ppm(buffer, FrameLayout(w, h), dst);
+}
+
+// the pixels of rect into rgb, a whole frame of packed RGB (3 * w bytes a
+// row); the rest of rgb is left alone
+inline void encode_rgb_rect(const uint32_t *buffer, const FrameLayout &layout,
+                            const Rect &rect, uint8_t *rgb,
+                            std::vector<uint32_t> &scratch) {
+  const size_t w = layout.w, rows = 64;
+  for (size_t y = rect.y0; y < rect.y1; y += rows) {
+    size_t y1 = std::min(rect.y1, y + rows);
+    const uint32_t *band = buffer + rect.x0 + y * w;
+    size_t stride = w;
+    if (layout.kind != Layout::RowMajor) {
+      scratch.resize((y1 - y) * rect.w());
+      layout.read_rows(buffer, y, y1, scratch.data(), rect.x0, rect.x1);
+      band = scratch.data();
+      stride = rect.w();
+    }
+    if (rect.w() == w) { // whole rows: one run
+      rgba_to_rgb(band, rgb + 3 * y * w, (y1 - y) * w);
+      continue;
+    }
+    for (size_t r = y; r < y1; r++)
+      rgba_to_rgb(band + (r - y) * stride, rgb + 3 * (rect.x0 + r * w),
+                  rect.w());
+  }
+}
+
+#if TRC_POSIX_IO
+// writev until everything is out (writes may be partial on pipes)
+inline bool write_all(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    while (count > 0 && size_t(n) >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+#endif
+
+// a file written piece by piece, for encoders that stream their output
+class FileOutput {
+public:
+  FileOutput() {}
+  FileOutput(const FileOutput &) = delete;
+  FileOutput &operator=(const FileOutput &) = delete;
+  ~FileOutput() { close(); }
+
+  bool open(const std::string &filename) {
+#if TRC_POSIX_IO
+    fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0;
+#else
+    ofs.open(filename, std::ios::binary);
+    ok = bool(ofs);
+#endif
+    return ok;
+  }
+  bool write(const void *data, size_t n) {
+#if TRC_POSIX_IO
+    struct iovec iov = {(void *)data, n};
+    ok = ok && write_all(fd, &iov, 1);
+#else
+    ok = ok && ofs.write((const char *)data, n);
+#endif
+    return ok;
+  }
+  // true if everything was written
+  bool close() {
+#if TRC_POSIX_IO
+    if (fd >= 0)
+      ok = ::close(fd) == 0 && ok;
+    fd = -1;
+#else
+    if (ofs.is_open())
+      ofs.close();
+    ok = ok && !ofs.fail();
+#endif
+    return ok;
+  }
+
+private:
+  bool ok = false;
+#if TRC_POSIX_IO
+  int fd = -1;
+#else
+  std::ofstream ofs;
+#endif
+};
+
+// converts the frame in large chunks and hands each one to the OS in a
+// single call (the header goes out with the first chunk). frames in another
+// layout are brought into row order chunk by chunk on the way
+class PpmWriter {
+public:
+  size_t chunk_pixels = 1 << 18; // 768 KiB of RGB per write
+
+  bool write(const std::string &filename, const uint32_t *buffer,
+             const FrameLayout &layout) {
+#if TRC_POSIX_IO
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      return false;
+    bool ok = write(fd, buffer, layout);
+    return close(fd) == 0 && ok;
+#else
+    std::ofstream ofs(filename, std::ios::binary);
+    std::string header = ppm_header(layout.w, layout.h);
+    ofs.write(header.data(), header.size());
+    for (size_t y = 0; y < layout.h; y += chunk_rows(layout.w)) {
+      size_t n = convert(buffer, layout, y);
+      ofs.write((const char *)rgb.data(), 3 * n);
+    }
+    return bool(ofs);
+#endif
+  }
+
+#if TRC_POSIX_IO
+  bool write(int fd, const uint32_t *buffer, const FrameLayout &layout) {
+    std::string header = ppm_header(layout.w, layout.h);
+    if (layout.w * layout.h == 0) {
+      struct iovec iov = {(void *)header.data(), header.size()};
+      return write_all(fd, &iov, 1);
+    }
+    for (size_t y = 0; y < layout.h; y += chunk_rows(layout.w)) {
+      size_t n = convert(buffer, layout, y);
+      struct iovec iov[2];
+      int count = 0;
+      if (y == 0)
+        iov[count++] = {(void *)header.data(), header.size()};
+      iov[count++] = {rgb.data(), 3 * n};
+      if (!write_all(fd, iov, count))
+        return false;
+    }
+    return true;
+  }
+#endif
+
+  bool write(const std::string &filename, const uint32_t *buffer, size_t w,
+             size_t h) {
+    return write(filename, buffer, FrameLayout(w, h));
+  }
+
+private:
+  std::vector<uint8_t> rgb;       // reused between frames
+  std::vector<uint32_t> scratch; // rows brought into row order
+
+  size_t chunk_rows(size_t w) const {
+    return std::max<size_t>(1, chunk_pixels / std::max<size_t>(w, 1));
+  }
+  // the chunk of rows starting at y into rgb, returns its pixel count
+  size_t convert(const uint32_t *buffer, const FrameLayout &layout, size_t y) {
+    size_t y1 = std::min(layout.h, y + chunk_rows(layout.w));
+    size_t n = (y1 - y) * layout.w;
+    rgb.resize(3 * n);
+    rgba_to_rgb(layout.row_major(buffer, y, y1, scratch), rgb.data(), n);
+    return n;
+  }
+};
+
+// a PPM file kept in memory from frame to frame: update() re-encodes only
+// the regions that changed since the last update, write() saves the file
+class PpmImage {
+public:
+  void update(const uint32_t *buffer, const FrameLayout &layout,
+              const std::vector<Rect> &dirty) {
+    if (file.empty() || layout.w != w || layout.h != h) { // everything
+      w = layout.w;
+      h = layout.h;
+      std::string header = ppm_header(w, h);
+      header_size = header.size();
+      file.resize(header_size + 3 * w * h);
+      memcpy(file.data(), header.data(), header_size);
+      encode_rgb_rect(buffer, layout, Rect(0, 0, w, h),
+                      file.data() + header_size, scratch);
+      return;
+    }
+    for (const Rect &rect : dirty)
+      encode_rgb_rect(buffer, layout,
+                      Rect(rect.x0, rect.y0, std::min(rect.x1, w),
+                           std::min(rect.y1, h)),
+                      file.data() + header_size, scratch);
+  }
+
+  bool write(const std::string &filename) const {
+#if TRC_POSIX_IO
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      return false;
+    struct iovec iov = {(void *)file.data(), file.size()};
+    bool ok = write_all(fd, &iov, 1);
+    return close(fd) == 0 && ok;
+#else
+    std::ofstream ofs(filename, std::ios::binary);
+    ofs.write((const char *)file.data(), file.size());
+    return bool(ofs);
+#endif
+  }
+  const std::vector<uint8_t> &bytes() const { return file; }
+
+private:
+  size_t w = 0;
+  size_t h = 0;
+  size_t header_size = 0;
+  std::vector<uint8_t> file;
+  std::vector<uint32_t> scratch; // rows brought into row order
+};
+
+inline bool write_ppm(const std::string &filename, const uint32_t *buffer,
+                      size_t w, size_t h) {
+  PpmWriter writer;
+  return writer.write(filename, buffer, w, h);
+}
+inline bool write_ppm(const std::string &filename, const uint32_t *buffer,
+                      const FrameLayout &layout) {
+  PpmWriter writer;
+  return writer.write(filename, buffer, layout);
+}
@@ -0,0 +1,231 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <vector>
+
+// how a framebuffer orders its pixels in memory.
+// RowMajor: the usual scanlines. ColumnMajor: one column after another, so a
+// vertical wall slice is sequential memory. Tiled: 8x8 tiles in row-major
+// order, each tile row-major inside; both directions stay within a few
+// cache lines
+enum class Layout : uint8_t { RowMajor, ColumnMajor, Tiled };
+
+// [x0,x1) x [y0,y1), unit: pixel
+struct Rect {
+  size_t x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+  Rect() {}
+  Rect(size_t x0, size_t y0, size_t x1, size_t y1)
+      : x0(x0), y0(y0), x1(x1), y1(y1) {}
+  size_t w() const { return x1 - x0; }
+  size_t h() const { return y1 - y0; }
+  bool empty() const { return x1 <= x0 || y1 <= y0; }
+  // empty if they don't overlap
+  Rect intersect(const Rect &o) const {
+    return Rect(std::max(x0, o.x0), std::max(y0, o.y0), std::min(x1, o.x1),
+                std::min(y1, o.y1));
+  }
+};
+
+// an allocator whose blocks start on a cache line, so buffers that
+// different threads fill don't share a line at their ends
+template <typename T> struct CacheAligned {
+  typedef T value_type;
+  enum : size_t { alignment = 64 };
+  CacheAligned() {}
+  template <typename U> CacheAligned(const CacheAligned<U> &) {}
+  T *allocate(size_t n) {
+    // over-allocated; what operator new returned is kept in front of the block
+    void *raw = ::operator new(n * sizeof(T) + alignment + sizeof(void *));
+    uintptr_t start = (uintptr_t(raw) + sizeof(void *) + alignment - 1) &
+                      ~uintptr_t(alignment - 1);
+    ((void **)start)[-1] = raw;
+    return (T *)start;
+  }
+  void deallocate(T *p, size_t) { ::operator delete(((void **)p)[-1]); }
+};
+template <typename T, typename U>
+bool operator==(const CacheAligned<T> &, const CacheAligned<U> &) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const CacheAligned<T> &, const CacheAligned<U> &) {
+  return false;
+}
+
+// a framebuffer's pixels, starting on a cache line
+typedef std::vector<uint32_t, CacheAligned<uint32_t>> PixelBuffer;
+
+struct FrameLayout {
+  enum : size_t { tile = 8 }; // tile edge, in pixels
+  Layout kind = Layout::RowMajor;
+  size_t w = 0;
+  size_t h = 0;
+
+  FrameLayout() {}
+  FrameLayout(size_t w, size_t h, Layout kind = Layout::RowMajor)
+      : kind(kind), w(w), h(h) {}
+
+  size_t tiles_x() const { return (w + tile - 1) / tile; }
+  size_t tiles_y() const { return (h + tile - 1) / tile; }
+  // the number of pixels the buffer needs (tiles are padded to whole tiles)
+  size_t size() const {
+    return kind == Layout::Tiled ? tiles_x() * tiles_y() * tile * tile : w * h;
+  }
+  size_t index(size_t x, size_t y) const {
+    switch (kind) {
+    case Layout::ColumnMajor:
+      return y + x * h;
+    case Layout::Tiled:
+      return ((y / tile) * tiles_x() + x / tile) * (tile * tile) +
+             (y % tile) * tile + x % tile;
+    default:
+      return x + y * w;
+    }
+  }
+
+  // copies the pixels [x0,x1) of rows [y0,y1) into dst in row-major order
+  // (x1 - x0 pixels per row); by default whole rows
+  void read_rows(const uint32_t *src, size_t y0, size_t y1, uint32_t *dst,
+                 size_t x0 = 0, size_t x1 = size_t(-1)) const {
+    x1 = std::min(x1, w);
+    const size_t n = x1 - x0;
+    if (kind == Layout::RowMajor) {
+      if (n == w) {
+        memcpy(dst, src + y0 * w, (y1 - y0) * w * sizeof(uint32_t));
+        return;
+      }
+      for (size_t y = y0; y < y1; y++)
+        memcpy(dst + (y - y0) * n, src + x0 + y * w, n * sizeof(uint32_t));
+    } else if (kind == Layout::ColumnMajor) {
+      // blocked transpose: 32 columns at a time so reads and writes both
+      // stay in cache
+      const size_t block = 32;
+      for (size_t xb = x0; xb < x1; xb += block) {
+        size_t xe = std::min(x1, xb + block);
+        for (size_t y = y0; y < y1; y++) {
+          uint32_t *out = dst + (y - y0) * n;
+          for (size_t x = xb; x < xe; x++)
+            out[x - x0] = src[y + x * h];
+        }
+      }
+    } else {
+      for (size_t y = y0; y < y1; y++) { // a row is one tile row after another
+        uint32_t *out = dst + (y - y0) * n;
+        for (size_t x = x0; x < x1;) {
+          size_t end = std::min(x1, (x / tile + 1) * tile);
+          memcpy(out + (x - x0), src + index(x, y),
+                 (end - x) * sizeof(uint32_t));
+          x = end;
+        }
+      }
+    }
+  }
+
+  // the reverse of read_rows: src holds rows [y0,y1) of x1 - x0 pixels each
+  // in row-major order, they go to [x0,x1) of those rows of dst
+  void write_rows(uint32_t *dst, size_t y0, size_t y1, const uint32_t *src,
+                  size_t x0 = 0, size_t x1 = size_t(-1)) const {
+    x1 = std::min(x1, w);
+    const size_t n = x1 - x0;
+    if (kind == Layout::RowMajor) {
+      if (n == w) {
+        memcpy(dst + y0 * w, src, (y1 - y0) * w * sizeof(uint32_t));
+        return;
+      }
+      for (size_t y = y0; y < y1; y++)
+        memcpy(dst + x0 + y * w, src + (y - y0) * n, n * sizeof(uint32_t));
+    } else if (kind == Layout::ColumnMajor) {
+      const size_t block = 32; // as in read_rows
+      for (size_t xb = x0; xb < x1; xb += block) {
+        size_t xe = std::min(x1, xb + block);
+        for (size_t y = y0; y < y1; y++) {
+          const uint32_t *in = src + (y - y0) * n;
+          for (size_t x = xb; x < xe; x++)
+            dst[y + x * h] = in[x - x0];
+        }
+      }
+    } else {
+      for (size_t y = y0; y < y1; y++) {
+        const uint32_t *in = src + (y - y0) * n;
+        for (size_t x = x0; x < x1;) {
+          size_t end = std::min(x1, (x / tile + 1) * tile);
+          memcpy(dst + index(x, y), in + (x - x0), (end - x) * sizeof(uint32_t));
+          x = end;
+        }
+      }
+    }
+  }
+
+  // copies the pixels of rect from src to dst, both in this layout
+  void copy_rect(const uint32_t *src, uint32_t *dst, const Rect &rect) const {
+    if (kind == Layout::ColumnMajor) {
+      for (size_t x = rect.x0; x < rect.x1; x++)
+        memcpy(dst + rect.y0 + x * h, src + rect.y0 + x * h,
+               rect.h() * sizeof(uint32_t));
+      return;
+    }
+    for (size_t y = rect.y0; y < rect.y1; y++) // spans of a row (or tile row)
+      for (size_t x = rect.x0; x < rect.x1;) {
+        size_t end = kind == Layout::Tiled
+                         ? std::min(rect.x1, (x / tile + 1) * tile)
+                         : rect.x1;
+        size_t i = index(x, y);
+        memcpy(dst + i, src + i, (end - x) * sizeof(uint32_t));
+        x = end;
+      }
+  }
+
+  // copies rect.w() x rect.h() pixels from (src_x, src_y) on of src, laid
+  // out as from, to rect of dst, laid out as this
+  void copy_rect_from(const FrameLayout &from, const uint32_t *src,
+                      size_t src_x, size_t src_y, uint32_t *dst,
+                      const Rect &rect) const {
+    for_each_span_from(from, src, src_x, src_y, dst, rect,
+                       [](uint32_t *d, const uint32_t *s, size_t n) {
+                         memcpy(d, s, n * sizeof(uint32_t));
+                       });
+  }
+  // copy_rect_from with span(d, s, n) doing the n pixels at once instead:
+  // runs of memory that are sequential in both, rows or columns when the
+  // kinds match, spans inside tiles
+  template <typename Span>
+  void for_each_span_from(const FrameLayout &from, const uint32_t *src,
+                          size_t src_x, size_t src_y, uint32_t *dst,
+                          const Rect &rect, Span span) const {
+    if (kind == Layout::ColumnMajor && from.kind == Layout::ColumnMajor) {
+      for (size_t x = rect.x0; x < rect.x1; x++)
+        span(dst + index(x, rect.y0),
+             src + from.index(src_x + x - rect.x0, src_y), rect.h());
+      return;
+    }
+    bool by_pixel =
+        kind == Layout::ColumnMajor || from.kind == Layout::ColumnMajor;
+    for (size_t y = rect.y0; y < rect.y1; y++) {
+      size_t sy = src_y + y - rect.y0;
+      for (size_t x = rect.x0; x < rect.x1;) {
+        size_t sx = src_x + x - rect.x0;
+        size_t end = by_pixel ? x + 1 : rect.x1;
+        if (kind == Layout::Tiled)
+          end = std::min(end, (x / tile + 1) * tile);
+        if (from.kind == Layout::Tiled)
+          end = std::min(end, x + (tile - sx % tile));
+        span(dst + index(x, y), src + from.index(sx, sy), end - x);
+        x = end;
+      }
+    }
+  }
+
+  // rows [y0,y1) in row-major order: straight from src when it already is,
+  // otherwise converted into scratch
+  const uint32_t *row_major(const uint32_t *src, size_t y0, size_t y1,
+                            std::vector<uint32_t> &scratch) const {
+    if (kind == Layout::RowMajor)
+      return src + y0 * w;
+    scratch.resize((y1 - y0) * w);
+    read_rows(src, y0, y1, scratch.data());
+    return scratch.data();
+  }
+};
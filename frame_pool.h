@@ -0,0 +1,131 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "encoder.h"
+
+#if TRC_POSIX_IO
+#include <sys/mman.h>
+#endif
+
+// framebuffers allocated once, page-aligned and touched up front, so frames
+// in flight see neither the allocator nor page faults. with huge_pages they
+// come from 2 MiB pages where the system has them reserved (MAP_HUGETLB),
+// else with a hint for transparent huge pages, else from plain pages
+class FramePool {
+public:
+  static const size_t page = 4096;
+  static const size_t huge_page = size_t(2) << 20;
+
+  FramePool(size_t count, size_t pixels, bool huge_pages = false) {
+    size_t bytes = std::max<size_t>(pixels * sizeof(uint32_t), 1);
+    for (size_t i = 0; i < count; i++) {
+      Block block = allocate(bytes, huge_pages);
+      memset(block.pixels, 0, bytes); // faults every page in now
+      blocks.push_back(block);
+    }
+  }
+  ~FramePool() {
+    for (const Block &block : blocks)
+      release(block);
+  }
+  FramePool(const FramePool &) = delete;
+  FramePool &operator=(const FramePool &) = delete;
+
+  size_t size() const { return blocks.size(); }
+  uint32_t *operator[](size_t i) const { return blocks[i].pixels; }
+  // whether the buffers are on reserved huge pages
+  bool huge() const { return !blocks.empty() && blocks[0].huge; }
+
+private:
+  struct Block {
+    uint32_t *pixels;
+    void *base; // what to release
+    size_t mapped; // bytes mapped, 0: from operator new
+    bool huge;
+  };
+  std::vector<Block> blocks;
+
+  static size_t round_up(size_t n, size_t to) { return (n + to - 1) / to * to; }
+
+  static Block allocate(size_t bytes, bool huge_pages) {
+#if TRC_POSIX_IO
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_HUGETLB
+    if (huge_pages) {
+      size_t mapped = round_up(bytes, huge_page);
+      void *p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                     flags | MAP_HUGETLB, -1, 0);
+      if (p != MAP_FAILED)
+        return Block{(uint32_t *)p, p, mapped, true};
+    }
+#endif
+    size_t mapped = round_up(bytes, huge_pages ? huge_page : page);
+    void *p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED)
+      throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+    if (huge_pages)
+      madvise(p, mapped, MADV_HUGEPAGE);
+#endif
+    return Block{(uint32_t *)p, p, mapped, false};
+#else
+    (void)huge_pages;
+    void *base = ::operator new(bytes + page);
+    uintptr_t start = (uintptr_t(base) + page - 1) & ~uintptr_t(page - 1);
+    return Block{(uint32_t *)start, base, 0, false};
+#endif
+  }
+  static void release(const Block &block) {
+#if TRC_POSIX_IO
+    munmap(block.base, block.mapped);
+#else
+    ::operator delete(block.base);
+#endif
+  }
+};
+
+// the hand-off between two pipeline stages: at most capacity items, push()
+// blocks while it is full and pop() while it is empty. the ring is sized
+// once, passing items through allocates nothing. close() lets pop() drain
+// what is left and then return false
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : ring(std::max<size_t>(capacity, 1)) {}
+
+  void push(const T &item) {
+    std::unique_lock<std::mutex> lock(m);
+    not_full.wait(lock, [this] { return count < ring.size(); });
+    ring[(head + count++) % ring.size()] = item;
+    not_empty.notify_one();
+  }
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(m);
+    not_empty.wait(lock, [this] { return count > 0 || closed; });
+    if (count == 0)
+      return false;
+    item = ring[head];
+    head = (head + 1) % ring.size();
+    count--;
+    not_full.notify_one();
+    return true;
+  }
+  void close() {
+    std::lock_guard<std::mutex> lock(m);
+    closed = true;
+    not_empty.notify_all();
+  }
+
+private:
+  std::vector<T> ring;
+  size_t head = 0;
+  size_t count = 0;
+  bool closed = false;
+  std::mutex m;
+  std::condition_variable not_full, not_empty;
+};
@@ -0,0 +1,243 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "encoder.h"
+#include "frame_pool.h"
+#include "profile.h"
+
+enum class StreamFormat {
+  Raw, // packed rgb24, e.g. ffmpeg -f rawvideo -pix_fmt rgb24 -s WxH -i -
+  Y4M, // YUV4MPEG2 4:4:4, ffmpeg reads it without extra flags
+};
+
+// writes a sequence of frames to a file or stdout ("-") as a pipeline: the
+// caller renders, one thread encodes, another writes. submit() copies the
+// regions that changed into a free framebuffer of a fixed ring, so the
+// caller renders frame N+2 while frame N+1 is being encoded and frame N
+// written, and only those regions are encoded again; the rest of the
+// output is kept from the frame before. the stages hand frames over
+// through bounded queues, up to num_buffers frames wait at each, and every
+// buffer is allocated up front: past the first frames, nothing is
+class FrameStream {
+public:
+  // layout: how the submitted buffers order their pixels. huge_pages: the
+  // framebuffers on 2 MiB pages, see FramePool
+  FrameStream(const std::string &path, const FrameLayout &layout,
+              StreamFormat format = StreamFormat::Raw, int fps = 30,
+              size_t num_buffers = 2, bool huge_pages = false)
+      : w(layout.w), h(layout.h), layout(layout), format(format), fps(fps),
+        pool(std::max<size_t>(num_buffers, 1), layout.size(), huge_pages),
+        frames(pool.size()), free_frames(pool.size()),
+        to_encode(pool.size()), outputs(pool.size()),
+        free_outputs(pool.size()), to_write(pool.size()) {
+    if (format == StreamFormat::Y4M)
+      stream_header = "YUV4MPEG2 W" + std::to_string(w) + " H" +
+                      std::to_string(h) + " F" + std::to_string(fps) +
+                      ":1 Ip A1:1 C444\n";
+    encoded.resize(3 * w * h);
+    for (size_t i = 0; i < pool.size(); i++) {
+      frames[i].pixels = pool[i];
+      frames[i].dirty.reserve(16);
+      free_frames.push(i);
+      outputs[i].bytes.resize(stream_header.size() + frame_header.size() +
+                              encoded.size());
+      free_outputs.push(i);
+    }
+    open_output(path);
+    encoder = std::thread([this] { encode_frames(); });
+    writer = std::thread([this] { write_frames(); });
+  }
+  ~FrameStream() { finish(); }
+  FrameStream(const FrameStream &) = delete;
+  FrameStream &operator=(const FrameStream &) = delete;
+
+  // queues the frame (layout.size() pixels), of which only the dirty regions
+  // are read (the first frame has to be dirty all over). blocks while all
+  // framebuffers are busy
+  void submit(const uint32_t *frame, const std::vector<Rect> &dirty) {
+    size_t i = 0;
+    free_frames.pop(i);
+    Frame &next = frames[i];
+    for (const Rect &rect : dirty)
+      layout.copy_rect(frame, next.pixels, rect);
+    next.dirty.assign(dirty.begin(), dirty.end()); // in its own memory
+    to_encode.push(i);
+  }
+
+  // waits until every submitted frame is written. returns false on an
+  // output error
+  bool finish() {
+    if (encoder.joinable()) {
+      to_encode.close(); // the encoder closes to_write once it is through
+      encoder.join();
+      writer.join();
+      close_output();
+    }
+    return ok;
+  }
+
+  // encoding and writing of the most recently finished frame
+  FrameStats stats() {
+    std::lock_guard<std::mutex> lock(m);
+    return last_stats;
+  }
+
+private:
+  size_t w;
+  size_t h;
+  FrameLayout layout;
+  StreamFormat format;
+  int fps;
+  struct Frame {
+    uint32_t *pixels; // from pool: current inside dirty, stale elsewhere
+    std::vector<Rect> dirty;
+  };
+  // an encoded frame waiting to be written
+  struct Output {
+    std::vector<uint8_t> bytes; // sized for the largest frame
+    size_t size = 0;
+    FrameStats stats; // of its encoding
+  };
+  FramePool pool;
+  std::vector<Frame> frames;
+  BoundedQueue<size_t> free_frames, to_encode; // indices into frames
+  std::vector<Output> outputs;
+  BoundedQueue<size_t> free_outputs, to_write; // indices into outputs
+  std::atomic<bool> ok{true};
+  std::mutex m;
+  FrameStats last_stats; // guarded by m
+  std::thread encoder, writer;
+  std::string stream_header; // before the first frame
+  const std::string frame_header = "FRAME\n"; // before each frame (y4m)
+  std::vector<uint8_t> encoded;   // the last frame, updated in place
+  std::vector<uint32_t> scratch; // rows brought into row order
+#if TRC_POSIX_IO
+  int fd = -1;
+#else
+  FILE *file = nullptr;
+#endif
+
+  void open_output(const std::string &path) {
+#if TRC_POSIX_IO
+    fd = path == "-" ? STDOUT_FILENO
+                     : open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0;
+#else
+    file = path == "-" ? stdout : fopen(path.c_str(), "wb");
+    ok = file != nullptr;
+#endif
+  }
+  void close_output() {
+#if TRC_POSIX_IO
+    if (fd > STDOUT_FILENO)
+      ok = close(fd) == 0 && ok;
+#else
+    if (file)
+      ok = fflush(file) == 0 && ok;
+    if (file && file != stdout)
+      fclose(file);
+#endif
+  }
+  bool write_out(const uint8_t *data, size_t n) {
+#if TRC_POSIX_IO
+    struct iovec iov = {(void *)data, n};
+    return write_all(fd, &iov, 1);
+#else
+    return fwrite(data, 1, n, file) == n;
+#endif
+  }
+  // full-range rgb -> studio-range BT.601 YCbCr, one plane after another.
+  // the n pixels of row y from x on
+  void to_yuv444(const uint32_t *span, size_t x, size_t y, size_t n) {
+    size_t plane = w * h;
+    uint8_t *luma = encoded.data() + x + y * w;
+    uint8_t *cb = luma + plane, *cr = cb + plane;
+    for (size_t i = 0; i < n; i++) {
+      uint32_t c = span[i];
+      int r = c & 255, g = (c >> 8) & 255, b = (c >> 16) & 255;
+      luma[i] = uint8_t(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+      cb[i] = uint8_t(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+      cr[i] = uint8_t(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+  }
+
+  // converts the dirty regions in bands of rows so other layouts only need
+  // a small scratch
+  void encode(const Frame &frame) {
+    const uint32_t *pixels = frame.pixels;
+    for (const Rect &dirty : frame.dirty) {
+      Rect rect(dirty.x0, dirty.y0, std::min(dirty.x1, w),
+                std::min(dirty.y1, h));
+      if (rect.empty())
+        continue;
+      if (format == StreamFormat::Raw) {
+        encode_rgb_rect(pixels, layout, rect, encoded.data(), scratch);
+        continue;
+      }
+      const size_t rows = 64;
+      for (size_t y = rect.y0; y < rect.y1; y += rows) {
+        size_t y1 = std::min(rect.y1, y + rows);
+        scratch.resize((y1 - y) * rect.w());
+        layout.read_rows(pixels, y, y1, scratch.data(), rect.x0, rect.x1);
+        for (size_t r = y; r < y1; r++)
+          to_yuv444(scratch.data() + (r - y) * rect.w(), rect.x0, r,
+                    rect.w());
+      }
+    }
+  }
+
+  void encode_frames() {
+    bool first = true;
+    size_t i = 0;
+    while (to_encode.pop(i)) {
+      FrameStats stats;
+      if (ok) {
+        TRC_STAGE(stats, Stage::Encode);
+        encode(frames[i]);
+      }
+      free_frames.push(i); // the caller may fill it again
+      size_t o = 0;
+      free_outputs.pop(o);
+      Output &out = outputs[o];
+      if (ok) {
+        TRC_STAGE(stats, Stage::Encode);
+        uint8_t *p = out.bytes.data();
+        if (first)
+          p = std::copy(stream_header.begin(), stream_header.end(), p);
+        if (format == StreamFormat::Y4M)
+          p = std::copy(frame_header.begin(), frame_header.end(), p);
+        p = std::copy(encoded.begin(), encoded.end(), p);
+        out.size = size_t(p - out.bytes.data());
+        first = false;
+      }
+      out.stats = stats;
+      to_write.push(o);
+    }
+    to_write.close();
+  }
+
+  void write_frames() {
+    size_t o = 0;
+    while (to_write.pop(o)) {
+      Output &out = outputs[o];
+      FrameStats stats = out.stats;
+      if (ok) {
+        TRC_STAGE(stats, Stage::Write);
+        ok = write_out(out.bytes.data(), out.size);
+        TRC_PROFILE_ONLY(stats.bytes_encoded = out.size;)
+      }
+      {
+        std::lock_guard<std::mutex> lock(m);
+        last_stats = stats;
+      }
+      free_outputs.push(o);
+    }
+  }
+};
@@ -6,6 +6,8 @@
 #include <vector>
 #include <cmath>
 
+#include "encoder.h"
+
 const double PI = 3.14159265358979323846;
 
 // a: alpha, transparency
@@ -25,13 +27,7 @@ void unpack_colors(const uint32_t color, uint8_t &r, uint8_t &g, uint8_t &b,
 void drop_ppm(std::string filename, const std::vector<uint32_t> &buffer,
               size_t w, size_t h) {
   assert(buffer.size() == w * h);
-  std::ofstream ofs(filename, std::ios::binary);
-  ofs << "P6\n" << w << " " << h << "\n" << 255 << "\n";
-  for (size_t i = 0; i < w * h; i++) {
-    uint8_t r, g, b, a;
-    unpack_colors(buffer[i], r, g, b, a);
-    ofs << r << g << b;
-  }
+  write_ppm(filename, buffer.data(), w, h);
 }
 
 void draw_rectangle(std::vector<uint32_t> &buffer, const size_t img_w,
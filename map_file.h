@@ -0,0 +1,203 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "encoder.h"
+#include "ray_packet.h"
+
+#if TRC_POSIX_IO
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// binary maps: a 64-byte header, the palette, then the cells.
+// the cells are stored exactly like the literal maps, one character per cell
+// ('0' empty, '0' + n a wall of material n), row after row, followed by
+// padding. that way the file itself can serve as the matrix: loading mmaps it
+// and copies nothing, pages come in as rays touch them, and every process
+// rendering the same map shares one copy in the page cache.
+// all numbers are little endian
+struct MapFileHeader {
+  char magic[4];         // "TRCM"
+  uint32_t version;      // 1
+  uint64_t w;            // unit: cells
+  uint64_t h;
+  uint32_t cell_bits;    // 8, one character per cell (the only kind so far)
+  uint32_t palette_size; // 0xAABBGGRR colors, palette[n] for material n
+  uint64_t cells_offset; // from the start of the file, a multiple of 64
+  uint8_t reserved[24];
+};
+static_assert(sizeof(MapFileHeader) == 64, "the header is 64 bytes on disk");
+
+class MapFile {
+public:
+  enum : size_t {
+    max_materials = 80, // '0' + 79 is the last character a char holds
+    tail = 64,          // padding behind the cells, at least PacketGrid's
+  };
+  static_assert(size_t(tail) >= size_t(PacketGrid::padding),
+                "map files must be readable in place by the packet kernels");
+
+  MapFile() {}
+  explicit MapFile(const std::string &path) { open(path); }
+  ~MapFile() { close(); }
+  MapFile(const MapFile &) = delete;
+  MapFile &operator=(const MapFile &) = delete;
+
+  // false when the file can't be read or isn't a map, see error(). the file
+  // may come from anywhere: the header and every cell are checked once here,
+  // so the casts can index with the cells unchecked
+  bool open(const std::string &path) {
+    close();
+    if (!map_in(path))
+      return false;
+    if (size < sizeof(MapFileHeader))
+      return fail("too short for a map header");
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, "TRCM", 4) != 0)
+      return fail("not a map file");
+    if (header.version != 1)
+      return fail("unsupported version " + std::to_string(header.version));
+    if (header.cell_bits != 8)
+      return fail("unsupported cell size " + std::to_string(header.cell_bits));
+    // cell indices x + y * w are 32-bit in the packet kernels' gathers
+    if (header.w == 0 || header.h == 0 || header.w > (1u << 30) ||
+        header.h > (1u << 30) || header.w * header.h >= (uint64_t(1) << 31))
+      return fail("bad dimensions");
+    if (header.palette_size > max_materials)
+      return fail("palette too large");
+    if (header.cells_offset % 64 != 0 ||
+        header.cells_offset < sizeof(header) + 4 * header.palette_size ||
+        header.cells_offset > size || size - header.cells_offset < tail ||
+        header.w > (size - header.cells_offset - tail) / header.h)
+      return fail("truncated");
+    const char *c = cells();
+    for (size_t i = 0, n = w() * h(); i < n; i++)
+      if ((unsigned char)c[i] < '0' ||
+          (unsigned char)c[i] >= '0' + max_materials)
+        return fail("bad cell at " + std::to_string(i % w()) + "," +
+                    std::to_string(i / w()));
+    return true;
+  }
+  void close() {
+#if TRC_POSIX_IO
+    if (data && !copy.size())
+      munmap((void *)data, size);
+#endif
+    copy.clear();
+    data = nullptr;
+    size = 0;
+  }
+  bool is_open() const { return data != nullptr; }
+  const std::string &error() const { return err; }
+
+  size_t w() const { return size_t(header.w); }
+  size_t h() const { return size_t(header.h); }
+  const char *cells() const {
+    return (const char *)data + header.cells_offset;
+  }
+  const uint32_t *palette() const {
+    return (const uint32_t *)(data + sizeof(header));
+  }
+  size_t palette_size() const { return header.palette_size; }
+  // the cells as they are in the file, no copy
+  PacketGrid packet_grid() const { return PacketGrid::view(cells(), w(), h()); }
+
+private:
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  std::vector<uint8_t> copy; // the whole file where there is no mmap
+  MapFileHeader header = {};
+  std::string err;
+
+  bool fail(const std::string &message) {
+    close();
+    err = message;
+    return false;
+  }
+  bool map_in(const std::string &path) {
+#if TRC_POSIX_IO
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return fail(strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      return fail("can't map an empty file");
+    }
+    void *p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // the mapping keeps the file
+    if (p == MAP_FAILED)
+      return fail(strerror(errno));
+    data = (const uint8_t *)p;
+    size = size_t(st.st_size);
+#else
+    std::ifstream in(path, std::ios::binary);
+    copy.assign(std::istreambuf_iterator<char>(in),
+                std::istreambuf_iterator<char>());
+    if (!in.good() && !in.eof())
+      return fail("can't read the file");
+    if (copy.empty())
+      return fail("empty file");
+    data = copy.data();
+    size = copy.size();
+#endif
+    return true;
+  }
+};
+
+// writes a literal map ('0'..'0' + 79 per cell) as a map file with the first
+// palette_size colors of palette. false when the matrix has other characters,
+// the palette is too large or the file can't be written
+inline bool save_map(const std::string &path, const char *matrix, size_t w,
+                     size_t h, const uint32_t *palette, size_t palette_size) {
+  if (palette_size > MapFile::max_materials)
+    return false;
+  for (size_t i = 0; i < w * h; i++) {
+    unsigned char c = matrix[i];
+    if (c < '0' || c >= '0' + MapFile::max_materials)
+      return false;
+  }
+  MapFileHeader header = {};
+  memcpy(header.magic, "TRCM", 4);
+  header.version = 1;
+  header.w = w;
+  header.h = h;
+  header.cell_bits = 8;
+  header.palette_size = uint32_t(palette_size);
+  header.cells_offset = (sizeof(header) + 4 * palette_size + 63) / 64 * 64;
+
+  std::ofstream out(path, std::ios::binary);
+  out.write((const char *)&header, sizeof(header));
+  out.write((const char *)palette, 4 * palette_size);
+  std::string gap(header.cells_offset - sizeof(header) - 4 * palette_size, 0);
+  out.write(gap.data(), gap.size());
+  out.write(matrix, w * h);
+  std::string padding(MapFile::tail, '0');
+  out.write(padding.data(), padding.size());
+  return bool(out.flush());
+}
+
+// the 16x16 map the programs fall back to without a map file
+inline const char *builtin_map() {
+  return "1111111111111111"
+         "1000000000000001"
+         "1000000000000001"
+         "1000555511000001"
+         "1000100000000001"
+         "1000100077711111"
+         "1000100000000001"
+         "1000100000000001"
+         "1000122222200001"
+         "1000003000900001"
+         "1000003000866111"
+         "1000000000800001"
+         "1000144111800001"
+         "1000100000000001"
+         "1000000000000001"
+         "1111111111111111";
+}
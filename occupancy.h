@@ -0,0 +1,119 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ray_packet.h"
+#include "raycast.h"
+#include "thread_pool.h"
+
+// which blocks of the map hold any wall, one bit per 16x16 and per 64x64
+// block (blocks on the right and bottom edge are cut off by the map). a ray
+// that stands in an empty block crosses all of it in one step, and only walks
+// cell by cell near walls. built once per map, read by any number of threads.
+// a skip costs about as much as half a dozen single steps, so smaller blocks
+// (4x4) lose more than they save; dense maps are faster without the pyramid
+class OccupancyPyramid {
+public:
+  enum : int { levels = 2 };
+  // log2 of the block edge per level
+  static int shift(int level) { return 4 + 2 * level; }
+
+  OccupancyPyramid() {}
+  OccupancyPyramid(const char *matrix, size_t w, size_t h) : w(w), h(h) {
+    for (int level = 0; level < levels; level++) {
+      blocks_w[level] = (w + (size_t(1) << shift(level)) - 1) >> shift(level);
+      blocks_h[level] = (h + (size_t(1) << shift(level)) - 1) >> shift(level);
+      stride[level] = (blocks_w[level] + 63) / 64;
+      bits[level].assign(stride[level] * blocks_h[level], 0);
+    }
+    // the finest level from the cells, a row of blocks per task (rows are
+    // padded to whole words so tasks never share one)
+    ThreadPool::shared().parallel_for(
+        0, blocks_h[0], 16, [&](size_t begin, size_t end) {
+          for (size_t y = begin << shift(0); y < std::min(h, end << shift(0));
+               y++)
+            for (size_t x = 0; x < w; x++)
+              if (matrix[x + y * w] != '0')
+                set(0, x >> shift(0), y >> shift(0));
+        });
+    // every coarser level from the one below
+    for (int level = 1; level < levels; level++) {
+      int ratio = shift(level) - shift(level - 1);
+      for (size_t by = 0; by < blocks_h[level - 1]; by++)
+        for (size_t bx = 0; bx < blocks_w[level - 1]; bx++)
+          if (occupied(level - 1, bx, by))
+            set(level, bx >> ratio, by >> ratio);
+    }
+  }
+
+  size_t grid_w() const { return w; }
+  size_t grid_h() const { return h; }
+  bool occupied(int level, size_t bx, size_t by) const {
+    return bits[level][by * stride[level] + bx / 64] >> (bx % 64) & 1;
+  }
+
+  // one step of a traversal: the whole empty block around the ray's cell at
+  // the coarsest level that has one, otherwise a single cell.
+  // (known_x,known_y): a finest block the ray is known to be in and to hold a
+  // wall, so the steps through it don't look the bits up again
+  float advance(raycast_detail::Dda &dda, WallSide &side, int &known_x,
+                int &known_y) const {
+    int fine_x = dda.map_x >> shift(0), fine_y = dda.map_y >> shift(0);
+    if (fine_x == known_x && fine_y == known_y)
+      return dda.step(side);
+    for (int level = levels - 1; level >= 0; level--) {
+      int s = shift(level);
+      int bx = dda.map_x >> s, by = dda.map_y >> s;
+      if (!occupied(level, bx, by)) {
+        int x1 = std::min(int(w), (bx + 1) << s);
+        int y1 = std::min(int(h), (by + 1) << s);
+        return dda.skip_box(bx << s, by << s, x1, y1, side);
+      }
+    }
+    known_x = fine_x;
+    known_y = fine_y;
+    return dda.step(side);
+  }
+
+private:
+  size_t w = 0;
+  size_t h = 0;
+  size_t blocks_w[levels] = {};
+  size_t blocks_h[levels] = {};
+  size_t stride[levels] = {}; // words per row of blocks
+  std::vector<uint64_t> bits[levels];
+
+  void set(int level, size_t bx, size_t by) {
+    bits[level][by * stride[level] + bx / 64] |= uint64_t(1) << (bx % 64);
+  }
+};
+
+// cast_ray_dir with empty space skipping. the same hits, bit for bit, in
+// fewer steps on open maps; the pyramid must be built from matrix
+inline RayHit cast_ray_dir(const OccupancyPyramid &pyramid, const char *matrix,
+                           float x, float y, float dir_x, float dir_y,
+                           float max_dis = 20) {
+  int known_x = -1, known_y = -1;
+  return raycast_detail::trace(
+      matrix, pyramid.grid_w(), pyramid.grid_h(), x, y, dir_x, dir_y, max_dis,
+      [&](raycast_detail::Dda &dda, WallSide &side) {
+        return pyramid.advance(dda, side, known_x, known_y);
+      });
+}
+
+inline RayHit cast_ray(const OccupancyPyramid &pyramid, const char *matrix,
+                       float x, float y, float angle, float max_dis = 20) {
+  return cast_ray_dir(pyramid, matrix, x, y, std::cos(angle), std::sin(angle),
+                      max_dis);
+}
+
+// cast_packet through the pyramid, one ray at a time
+inline void cast_packet(const OccupancyPyramid &pyramid, const char *matrix,
+                        float x, float y, RayPacket &p, const uint32_t *palette,
+                        size_t begin, size_t end, float max_dis = 20) {
+  cast_packet_each(p, palette, begin, end, [&](float dir_x, float dir_y) {
+    return cast_ray_dir(pyramid, matrix, x, y, dir_x, dir_y, max_dis);
+  });
+}
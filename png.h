@@ -0,0 +1,640 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "encoder.h"
+#include "frame_layout.h"
+#include "thread_pool.h"
+
+// PNG, 8-bit RGB (alpha dropped as in the PPM). the rows are cut into
+// chunks that are filtered and deflated independently on the thread pool,
+// each its own run of deflate blocks ending on a byte boundary (an empty
+// stored block, as a sync flush does) and its own IDAT; the zlib stream is
+// their concatenation. a chunk's matches don't reach into the one before,
+// which costs little on frames of flat slices and gradients
+
+namespace png_detail {
+
+struct CrcTable {
+  uint32_t t[256];
+  CrcTable() {
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++)
+        c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      t[n] = c;
+    }
+  }
+};
+// crc is the running value, ~0 at first and inverted at the end
+inline uint32_t crc_update(uint32_t crc, const uint8_t *p, size_t n) {
+  static const CrcTable table;
+  for (size_t i = 0; i < n; i++)
+    crc = table.t[(crc ^ p[i]) & 255] ^ (crc >> 8);
+  return crc;
+}
+
+const uint32_t adler_base = 65521;
+// adler is 1 at first
+inline uint32_t adler32(uint32_t adler, const uint8_t *p, size_t n) {
+  uint32_t a = adler & 0xFFFF, b = adler >> 16;
+  while (n) {
+    size_t k = std::min<size_t>(n, 5552); // b can't overflow before the mod
+    n -= k;
+    for (; k; k--) {
+      a += *p++;
+      b += a;
+    }
+    a %= adler_base;
+    b %= adler_base;
+  }
+  return a | b << 16;
+}
+// the checksum of two pieces back to back, len2 the second one's length
+inline uint32_t adler32_combine(uint32_t adler1, uint32_t adler2,
+                                size_t len2) {
+  uint32_t rem = uint32_t(len2 % adler_base);
+  uint32_t a = adler1 & 0xFFFF;
+  uint32_t b = uint32_t(uint64_t(rem) * a % adler_base);
+  a += (adler2 & 0xFFFF) + adler_base - 1;
+  b += (adler1 >> 16) + (adler2 >> 16) + adler_base - rem;
+  if (a >= adler_base)
+    a -= adler_base;
+  if (a >= adler_base)
+    a -= adler_base;
+  if (b >= 2 * adler_base)
+    b -= 2 * adler_base;
+  if (b >= adler_base)
+    b -= adler_base;
+  return a | b << 16;
+}
+
+// least significant bit first, as deflate wants
+struct BitWriter {
+  std::vector<uint8_t> &out;
+  uint64_t bits = 0;
+  int count = 0;
+  explicit BitWriter(std::vector<uint8_t> &out) : out(out) {}
+  void put(uint32_t value, int n) {
+    bits |= uint64_t(value) << count;
+    count += n;
+    for (; count >= 8; count -= 8, bits >>= 8)
+      out.push_back(uint8_t(bits));
+  }
+  void align() {
+    if (count > 0)
+      put(0, 8 - count);
+  }
+};
+
+// code lengths for the symbols by frequency, none longer than limit, 0 for
+// the unused ones. frequencies are flattened until the tree is shallow
+// enough. a lone symbol gets a partner, decoders want complete codes
+inline void huffman_lengths(const uint32_t *freq, size_t n, int limit,
+                            uint8_t *lengths) {
+  std::vector<uint32_t> f(freq, freq + n);
+  std::vector<size_t> leaves;
+  struct Node {
+    uint64_t freq;
+    size_t parent;
+  };
+  std::vector<Node> nodes;
+  for (;;) {
+    std::fill_n(lengths, n, 0);
+    leaves.clear();
+    for (size_t i = 0; i < n; i++)
+      if (f[i])
+        leaves.push_back(i);
+    if (leaves.size() < 2) {
+      size_t used = leaves.empty() ? 0 : leaves[0];
+      lengths[used] = 1;
+      lengths[used == 0 ? 1 : 0] = 1;
+      return;
+    }
+    std::stable_sort(leaves.begin(), leaves.end(),
+                     [&](size_t a, size_t b) { return f[a] < f[b]; });
+    // two queues: the leaves in order, and the merged nodes, which come
+    // out in order too
+    nodes.clear();
+    for (size_t i : leaves)
+      nodes.push_back({f[i], 0});
+    size_t leaf = 0, merged = leaves.size();
+    auto smallest = [&]() {
+      if (leaf < leaves.size() &&
+          (merged >= nodes.size() || nodes[leaf].freq <= nodes[merged].freq))
+        return leaf++;
+      return merged++;
+    };
+    for (size_t k = 1; k < leaves.size(); k++) {
+      size_t a = smallest(), b = smallest();
+      nodes.push_back({nodes[a].freq + nodes[b].freq, 0});
+      nodes[a].parent = nodes[b].parent = nodes.size() - 1;
+    }
+    std::vector<int> depth(nodes.size(), 0);
+    int deepest = 0;
+    for (size_t k = nodes.size() - 1; k-- > 0;) {
+      depth[k] = depth[nodes[k].parent] + 1;
+      deepest = std::max(deepest, depth[k]);
+    }
+    if (deepest <= limit) {
+      for (size_t i = 0; i < leaves.size(); i++)
+        lengths[leaves[i]] = uint8_t(depth[i]);
+      return;
+    }
+    for (uint32_t &x : f)
+      if (x)
+        x = (x + 1) / 2;
+  }
+}
+
+// canonical codes for the lengths, bit-reversed for BitWriter
+inline void huffman_codes(const uint8_t *lengths, size_t n, uint16_t *codes) {
+  uint16_t count[16] = {0}, next[16] = {0};
+  for (size_t i = 0; i < n; i++)
+    count[lengths[i]]++;
+  count[0] = 0;
+  uint16_t code = 0;
+  for (int bits = 1; bits < 16; bits++) {
+    code = uint16_t((code + count[bits - 1]) << 1);
+    next[bits] = code;
+  }
+  for (size_t i = 0; i < n; i++) {
+    int len = lengths[i];
+    if (!len)
+      continue;
+    uint16_t c = next[len]++, reversed = 0;
+    for (int k = 0; k < len; k++)
+      reversed = uint16_t(reversed << 1 | (c >> k & 1));
+    codes[i] = reversed;
+  }
+}
+
+// the symbols and extra bits of match lengths 3..258 and distances
+// 1..32768 (RFC 1951, 3.2.5)
+struct DeflateTables {
+  uint8_t length_code[259];
+  uint8_t dist_code[512]; // distance - 1 below 256, (distance - 1) >> 7 above
+  static const uint16_t *length_base() {
+    static const uint16_t base[29] = {3,  4,  5,  6,  7,  8,  9,  10, 11, 13,
+                                      15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+                                      67, 83, 99, 115, 131, 163, 195, 227, 258};
+    return base;
+  }
+  static const uint8_t *length_extra() {
+    static const uint8_t extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                      1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                      4, 4, 4, 4, 5, 5, 5, 5, 0};
+    return extra;
+  }
+  static const uint16_t *dist_base() {
+    static const uint16_t base[30] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    return base;
+  }
+  static const uint8_t *dist_extra() {
+    static const uint8_t extra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                      4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                      9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    return extra;
+  }
+  DeflateTables() {
+    for (int code = 0; code < 29; code++)
+      for (int len = length_base()[code];
+           len < length_base()[code] + (1 << length_extra()[code]) && len <= 258;
+           len++)
+        length_code[len] = uint8_t(code);
+    length_code[258] = 28; // 227 + 31 is code 27's too, 258 has its own
+    for (int code = 0; code < 30; code++)
+      for (int d = dist_base()[code];
+           d < dist_base()[code] + (1 << dist_extra()[code]); d++) {
+        if (d <= 256)
+          dist_code[d - 1] = uint8_t(code);
+        else
+          dist_code[256 + ((d - 1) >> 7)] = uint8_t(code);
+      }
+  }
+  int distance(uint32_t d) const {
+    return d <= 256 ? dist_code[d - 1] : dist_code[256 + ((d - 1) >> 7)];
+  }
+  static const DeflateTables &get() {
+    static const DeflateTables tables;
+    return tables;
+  }
+};
+
+inline size_t match_length(const uint8_t *a, const uint8_t *b, size_t max) {
+  size_t len = 0;
+#if defined(__GNUC__)
+  for (; len + 8 <= max; len += 8) {
+    uint64_t x, y;
+    memcpy(&x, a + len, 8);
+    memcpy(&y, b + len, 8);
+    if (x != y) // little endian: the first difference is the lowest
+      return len + __builtin_ctzll(x ^ y) / 8;
+  }
+#endif
+  while (len < max && a[len] == b[len])
+    len++;
+  return len;
+}
+
+// deflate of a piece of the stream that refers to nothing before it:
+// greedy matches from hash chains, blocks with their own Huffman codes
+class Deflater {
+public:
+  int max_chain = 16;   // candidates tried per position
+  size_t nice = 128;    // a match this long is taken without looking on
+  size_t block = 1 << 15; // tokens per block
+
+  // appends the deflated data to out. the last piece of the stream ends
+  // with a final block, the others with an empty stored block; either way
+  // on a byte boundary
+  void compress(const uint8_t *data, size_t n, bool last,
+                std::vector<uint8_t> &out) {
+    tokens.clear();
+    find_matches(data, n);
+    BitWriter bits(out);
+    for (size_t begin = 0; begin < tokens.size() || begin == 0;
+         begin += block) {
+      size_t end = std::min(tokens.size(), begin + block);
+      write_block(begin, end, last && end == tokens.size(), bits);
+    }
+    if (!last) {
+      bits.put(0, 3); // not final, stored
+      bits.align();
+      static const uint8_t empty[4] = {0, 0, 0xFF, 0xFF};
+      out.insert(out.end(), empty, empty + 4);
+    } else {
+      bits.align();
+    }
+  }
+
+private:
+  static const int hash_bits = 15;
+  static const size_t window = 32768;
+  std::vector<int32_t> head, prev;
+  // a literal, or 1 << 31 | (length - 3) << 16 | (distance - 1)
+  std::vector<uint32_t> tokens;
+
+  static uint32_t hash(const uint8_t *p) {
+    return (uint32_t(p[0]) << 16 | uint32_t(p[1]) << 8 | p[2]) * 2654435761u >>
+           (32 - hash_bits);
+  }
+
+  void find_matches(const uint8_t *data, size_t n) {
+    head.assign(size_t(1) << hash_bits, -1);
+    prev.resize(window);
+    auto insert = [&](size_t pos) {
+      uint32_t h = hash(data + pos);
+      prev[pos % window] = head[h];
+      head[h] = int32_t(pos);
+    };
+    for (size_t pos = 0; pos < n;) {
+      if (pos + 3 > n) {
+        tokens.push_back(data[pos++]);
+        continue;
+      }
+      int32_t cand = head[hash(data + pos)];
+      insert(pos);
+      size_t best = 0, dist = 0, max = std::min<size_t>(258, n - pos);
+      // older than the window, a candidate's chain entry may be overwritten
+      for (int chain = max_chain; cand >= 0 && pos - cand < window && chain--;
+           cand = prev[cand % window]) {
+        if (data[cand + best] != data[pos + best])
+          continue;
+        size_t len = match_length(data + cand, data + pos, max);
+        if (len > best) {
+          best = len;
+          dist = pos - cand;
+          if (len >= std::min(nice, max))
+            break;
+        }
+      }
+      if (best < 3) {
+        tokens.push_back(data[pos++]);
+        continue;
+      }
+      tokens.push_back(1u << 31 | uint32_t(best - 3) << 16 | uint32_t(dist - 1));
+      // the positions inside the match are candidates for later ones; of a
+      // long one (a run, mostly) only its end, the rest is the same again
+      size_t end = pos + best;
+      for (pos = best > 32 ? end - 4 : pos + 1; pos < end; pos++)
+        if (pos + 3 <= n)
+          insert(pos);
+    }
+  }
+
+  void write_block(size_t begin, size_t end, bool final, BitWriter &bits) {
+    const DeflateTables &t = DeflateTables::get();
+    uint32_t lit_freq[286] = {0}, dist_freq[30] = {0};
+    for (size_t i = begin; i < end; i++) {
+      uint32_t token = tokens[i];
+      if (token >> 31) {
+        lit_freq[257 + t.length_code[(token >> 16 & 0x7FFF) + 3]]++;
+        dist_freq[t.distance((token & 0xFFFF) + 1)]++;
+      } else {
+        lit_freq[token]++;
+      }
+    }
+    lit_freq[256] = 1; // end of block
+    uint8_t lengths[286 + 30];
+    uint8_t *lit_len = lengths, *dist_len = lengths + 286;
+    huffman_lengths(lit_freq, 286, 15, lit_len);
+    huffman_lengths(dist_freq, 30, 15, dist_len);
+    size_t hlit = 286, hdist = 30;
+    while (hlit > 257 && !lit_len[hlit - 1])
+      hlit--;
+    while (hdist > 1 && !dist_len[hdist - 1])
+      hdist--;
+    // the lengths back to back, with runs as code length symbols 16-18
+    uint8_t all[286 + 30];
+    memcpy(all, lit_len, hlit);
+    memcpy(all + hlit, dist_len, hdist);
+    size_t total = hlit + hdist;
+    std::vector<uint16_t> symbols; // symbol | extra bits << 5
+    uint32_t cl_freq[19] = {0};
+    for (size_t i = 0; i < total;) {
+      uint8_t len = all[i];
+      size_t run = 1;
+      while (i + run < total && all[i + run] == len)
+        run++;
+      if (len == 0 && run >= 3) {
+        run = std::min<size_t>(run, 138);
+        symbols.push_back(uint16_t(run <= 10 ? 17 | (run - 3) << 5
+                                             : 18 | (run - 11) << 5));
+        cl_freq[run <= 10 ? 17 : 18]++;
+      } else if (len != 0 && run >= 4) {
+        run = std::min<size_t>(run, 7); // the length, then 3-6 repeats
+        symbols.push_back(len);
+        symbols.push_back(uint16_t(16 | (run - 4) << 5));
+        cl_freq[len]++;
+        cl_freq[16]++;
+      } else {
+        run = 1;
+        symbols.push_back(len);
+        cl_freq[len]++;
+      }
+      i += run;
+    }
+    static const uint8_t order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                      11, 4,  12, 3, 13, 2, 14, 1, 15};
+    uint8_t cl_len[19];
+    uint16_t cl_code[19] = {0}, lit_code[286] = {0}, dist_code[30] = {0};
+    huffman_lengths(cl_freq, 19, 7, cl_len);
+    huffman_codes(cl_len, 19, cl_code);
+    huffman_codes(lit_len, 286, lit_code);
+    huffman_codes(dist_len, 30, dist_code);
+    size_t hclen = 19;
+    while (hclen > 4 && !cl_len[order[hclen - 1]])
+      hclen--;
+
+    bits.put(final, 1);
+    bits.put(2, 2); // dynamic Huffman codes
+    bits.put(uint32_t(hlit - 257), 5);
+    bits.put(uint32_t(hdist - 1), 5);
+    bits.put(uint32_t(hclen - 4), 4);
+    for (size_t i = 0; i < hclen; i++)
+      bits.put(cl_len[order[i]], 3);
+    static const int cl_extra[3] = {2, 3, 7};
+    for (uint16_t s : symbols) {
+      int symbol = s & 31;
+      bits.put(cl_code[symbol], cl_len[symbol]);
+      if (symbol >= 16)
+        bits.put(s >> 5, cl_extra[symbol - 16]);
+    }
+    for (size_t i = begin; i < end; i++) {
+      uint32_t token = tokens[i];
+      if (!(token >> 31)) {
+        bits.put(lit_code[token], lit_len[token]);
+        continue;
+      }
+      uint32_t len = (token >> 16 & 0x7FFF) + 3, dist = (token & 0xFFFF) + 1;
+      int lc = t.length_code[len], dc = t.distance(dist);
+      bits.put(lit_code[257 + lc], lit_len[257 + lc]);
+      bits.put(len - DeflateTables::length_base()[lc],
+               DeflateTables::length_extra()[lc]);
+      bits.put(dist_code[dc], dist_len[dc]);
+      bits.put(dist - DeflateTables::dist_base()[dc],
+               DeflateTables::dist_extra()[dc]);
+    }
+    bits.put(lit_code[256], lit_len[256]);
+  }
+};
+
+// the predictor's distances without forming a + b - c: selects only, so
+// the loop over a row vectorizes
+inline uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+  int pa = std::abs(int(b) - c), pb = std::abs(int(a) - c),
+      pc = std::abs(int(a) + b - 2 * c);
+  int ab = pb < pa ? b : a, min_ab = pb < pa ? pb : pa;
+  return uint8_t(pc < min_ab ? c : ab);
+}
+
+// the row as filter type + filtered bytes into out (1 + n bytes), with the
+// filter that gives the smallest sum of absolute values (the usual
+// heuristic). prior is the row above, zeros for the first one. a loop per
+// filter, the first pixel apart: they vectorize, except Paeth
+inline void filter_row(const uint8_t *row, const uint8_t *prior, size_t n,
+                       uint8_t *out, std::vector<uint8_t> &trial) {
+  trial.resize(5 * n);
+  uint8_t *f[5];
+  for (int type = 0; type < 5; type++)
+    f[type] = trial.data() + type * n;
+  size_t head = std::min<size_t>(3, n);
+  for (size_t i = 0; i < head; i++) { // nothing to the left
+    f[0][i] = row[i];
+    f[1][i] = row[i];
+    f[2][i] = uint8_t(row[i] - prior[i]);
+    f[3][i] = uint8_t(row[i] - prior[i] / 2);
+    f[4][i] = uint8_t(row[i] - prior[i]); // paeth(0, up, 0) is up
+  }
+  memcpy(f[0] + head, row + head, n - head);
+  for (size_t i = head; i < n; i++)
+    f[1][i] = uint8_t(row[i] - row[i - 3]);
+  for (size_t i = head; i < n; i++)
+    f[2][i] = uint8_t(row[i] - prior[i]);
+  for (size_t i = head; i < n; i++)
+    f[3][i] = uint8_t(row[i] - ((row[i - 3] + prior[i]) >> 1));
+  for (size_t i = head; i < n; i++)
+    f[4][i] = uint8_t(row[i] - paeth(row[i - 3], prior[i], prior[i - 3]));
+  uint32_t best_sum = ~0u;
+  int best = 0;
+  for (int type = 0; type < 5; type++) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < n; i++)
+      sum += uint32_t(std::abs(int(int8_t(f[type][i]))));
+    if (sum < best_sum) {
+      best_sum = sum;
+      best = type;
+    }
+  }
+  out[0] = uint8_t(best);
+  memcpy(out + 1, f[best], n);
+}
+
+} // namespace png_detail
+
+class PngEncoder {
+public:
+  size_t chunk_bytes = 1 << 18; // filtered bytes deflated by one task
+
+  // streams the file to out(const uint8_t *, size_t): the chunks are done a
+  // few per thread at a time, straight from the frame's pixels, and go out
+  // in order; false when out fails
+  template <typename Out>
+  bool encode(const uint32_t *buffer, const FrameLayout &layout, Out out) {
+    using namespace png_detail;
+    const size_t w = layout.w, h = layout.h, stride = 3 * w + 1;
+    const size_t rows = std::max<size_t>(1, chunk_bytes / stride);
+    const size_t num_chunks = std::max<size_t>(1, (h + rows - 1) / rows);
+
+    std::vector<uint8_t> head = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    uint8_t ihdr[13] = {0};
+    put32(ihdr, uint32_t(w));
+    put32(ihdr + 4, uint32_t(h));
+    ihdr[8] = 8; // bits per channel
+    ihdr[9] = 2; // rgb
+    append_chunk(head, "IHDR", ihdr, sizeof(ihdr));
+    if (!out(head.data(), head.size()))
+      return false;
+
+    uint32_t adler = 1;
+    const size_t batch = 2 * ThreadPool::shared().size();
+    pieces.resize(std::min(batch, num_chunks));
+    for (size_t first = 0; first < num_chunks; first += batch) {
+      size_t count = std::min(batch, num_chunks - first);
+      ThreadPool::shared().parallel_for(
+          0, count, 1, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; k++) {
+              size_t c = first + k;
+              deflate_rows(buffer, layout, c * rows,
+                           std::min(h, (c + 1) * rows), c == 0,
+                           c + 1 == num_chunks, pieces[k]);
+            }
+          });
+      for (size_t k = 0; k < count; k++) {
+        Piece &piece = pieces[k];
+        adler = adler32_combine(adler, piece.adler, piece.raw_size);
+        if (first + k + 1 == num_chunks) { // the zlib stream's end
+          uint8_t sum[4];
+          put32(sum, adler);
+          piece.data.insert(piece.data.end(), sum, sum + 4);
+        }
+        chunk.clear();
+        append_chunk(chunk, "IDAT", piece.data.data(), piece.data.size());
+        if (!out(chunk.data(), chunk.size()))
+          return false;
+      }
+    }
+    chunk.clear();
+    append_chunk(chunk, "IEND", nullptr, 0);
+    return out(chunk.data(), chunk.size());
+  }
+
+  // the whole file in memory
+  std::vector<uint8_t> encode(const uint32_t *buffer,
+                              const FrameLayout &layout) {
+    std::vector<uint8_t> file;
+    encode(buffer, layout, [&](const uint8_t *data, size_t n) {
+      file.insert(file.end(), data, data + n);
+      return true;
+    });
+    return file;
+  }
+
+  bool write(const std::string &filename, const uint32_t *buffer,
+             const FrameLayout &layout) {
+    FileOutput file;
+    if (!file.open(filename))
+      return false;
+    bool ok = encode(buffer, layout, [&](const uint8_t *data, size_t n) {
+      return file.write(data, n);
+    });
+    return file.close() && ok;
+  }
+
+private:
+  // a chunk of rows, deflated
+  struct Piece {
+    std::vector<uint8_t> data;
+    uint32_t adler = 1; // of the filtered rows
+    size_t raw_size = 0;
+  };
+  std::vector<Piece> pieces; // reused between frames
+  std::vector<uint8_t> chunk;
+
+  // what a thread keeps between chunks
+  struct Scratch {
+    png_detail::Deflater deflater;
+    std::vector<uint8_t> filtered, rgb, trial;
+    std::vector<uint32_t> rows; // brought into row order
+  };
+  static Scratch &scratch() {
+    static thread_local Scratch s;
+    return s;
+  }
+
+  static void put32(uint8_t *p, uint32_t v) { // big endian
+    p[0] = uint8_t(v >> 24);
+    p[1] = uint8_t(v >> 16);
+    p[2] = uint8_t(v >> 8);
+    p[3] = uint8_t(v);
+  }
+  static void append_chunk(std::vector<uint8_t> &file, const char *type,
+                           const uint8_t *data, size_t n) {
+    uint8_t word[4];
+    put32(word, uint32_t(n));
+    file.insert(file.end(), word, word + 4);
+    size_t start = file.size();
+    file.insert(file.end(), type, type + 4);
+    if (n)
+      file.insert(file.end(), data, data + n);
+    uint32_t crc = ~png_detail::crc_update(~0u, file.data() + start,
+                                           file.size() - start);
+    put32(word, crc);
+    file.insert(file.end(), word, word + 4);
+  }
+
+  // rows [y0,y1) filtered and deflated into piece; the row above y0 is
+  // converted again for the filters, chunks share nothing
+  static void deflate_rows(const uint32_t *buffer, const FrameLayout &layout,
+                           size_t y0, size_t y1, bool first, bool last,
+                           Piece &piece) {
+    Scratch &s = scratch();
+    const size_t n = 3 * layout.w, stride = n + 1;
+    s.filtered.resize((y1 - y0) * stride);
+    s.rgb.assign(2 * n, 0); // the row above, this row
+    uint8_t *prior = s.rgb.data(), *row = s.rgb.data() + n;
+    if (y0 > 0)
+      rgba_to_rgb(layout.row_major(buffer, y0 - 1, y0, s.rows), prior,
+                  layout.w);
+    for (size_t y = y0; y < y1; y++) {
+      rgba_to_rgb(layout.row_major(buffer, y, y + 1, s.rows), row, layout.w);
+      png_detail::filter_row(row, prior, n,
+                             s.filtered.data() + (y - y0) * stride, s.trial);
+      std::swap(prior, row);
+    }
+    piece.raw_size = s.filtered.size();
+    piece.adler = png_detail::adler32(1, s.filtered.data(), s.filtered.size());
+    piece.data.clear();
+    if (first) { // zlib: deflate, 32K window, no dictionary
+      piece.data.push_back(0x78);
+      piece.data.push_back(0x01);
+    }
+    s.deflater.compress(s.filtered.data(), s.filtered.size(), last,
+                        piece.data);
+  }
+};
+
+inline bool write_png(const std::string &filename, const uint32_t *buffer,
+                      const FrameLayout &layout) {
+  PngEncoder encoder;
+  return encoder.write(filename, buffer, layout);
+}
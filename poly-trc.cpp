@@ -1,16 +1,9 @@
 #include "poly-trc.h"
+#include "encoder.h"
 #include <iterator>
 
 void Window::to_ppm(std::string filename) {
-  std::ofstream
-        ofs(filename, std::ios::binary); // binary mode is necessary for PPM
-    ofs << "P6\n" << w << " " << h << "\n" << 255 << "\n";
-    for (size_t i = 0; i < w * h; i++) {
-        uint8_t r, g, b, a;
-        unpack_colors(buffer[i], r, g, b, a);
-        ofs << r << g << b;
-    }
-    ofs.close();
+  write_ppm(filename, buffer.data(), w, h);
 }
 
 uint32_t pack_colors(const uint8_t r, const uint8_t g, const uint8_t b,
@@ -0,0 +1,133 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <string>
+
+// per-frame instrumentation of the render loop. everything that measures
+// or counts is wrapped in TRC_PROFILE_ONLY / TRC_STAGE, which compile to
+// nothing unless TRC_PROFILE is defined (cmake -DTRC_PROFILE=ON). the
+// FrameStats structs exist either way and simply stay zero
+#ifdef TRC_PROFILE
+#define TRC_PROFILE_ONLY(...) __VA_ARGS__
+#define TRC_STAGE_CAT(a, b) a##b
+#define TRC_STAGE_NAME(line) TRC_STAGE_CAT(trc_stage_timer_, line)
+// times the rest of the enclosing scope as one stage
+#define TRC_STAGE(stats, stage) StageTimer TRC_STAGE_NAME(__LINE__)(stats, stage)
+#else
+#define TRC_PROFILE_ONLY(...)
+#define TRC_STAGE(stats, stage)
+#endif
+
+enum class Stage {
+  Cast,      // tracing rays through the map
+  Fill,      // shading and filling pixels
+  Composite, // the whole Screen::render, all windows into the buffer
+  Encode,    // framebuffer -> bytes
+  Write,     // bytes -> file or pipe
+  Count
+};
+
+inline const char *stage_name(Stage stage) {
+  static const char *names[] = {"cast", "fill", "composite", "encode",
+                                "write"};
+  return names[int(stage)];
+}
+
+struct FrameStats {
+  double seconds[int(Stage::Count)] = {}; // wall-clock time per stage
+  uint64_t rays = 0;
+  uint64_t ray_steps = 0;     // iterations of the traversal loops
+  uint64_t cells_visited = 0; // map cells looked at
+  uint64_t pixels_written = 0;
+  uint64_t bytes_encoded = 0;
+
+  double &time(Stage stage) { return seconds[int(stage)]; }
+  FrameStats &operator+=(const FrameStats &other) {
+    for (int i = 0; i < int(Stage::Count); i++)
+      seconds[i] += other.seconds[i];
+    rays += other.rays;
+    ray_steps += other.ray_steps;
+    cells_visited += other.cells_visited;
+    pixels_written += other.pixels_written;
+    bytes_encoded += other.bytes_encoded;
+    return *this;
+  }
+
+  static std::string csv_header() {
+    return "cast_s,fill_s,composite_s,encode_s,write_s,rays,ray_steps,"
+           "cells_visited,"
+           "pixels_written,bytes_encoded";
+  }
+  void to_csv(std::ostream &os) const {
+    for (int i = 0; i < int(Stage::Count); i++)
+      os << seconds[i] << ",";
+    os << rays << "," << ray_steps << "," << cells_visited << ","
+       << pixels_written << "," << bytes_encoded;
+  }
+  // the members of a JSON object, without the braces
+  void to_json(std::ostream &os) const {
+    for (int i = 0; i < int(Stage::Count); i++)
+      os << "\"" << stage_name(Stage(i)) << "_s\": " << seconds[i] << ", ";
+    os << "\"rays\": " << rays << ", \"ray_steps\": " << ray_steps
+       << ", \"cells_visited\": " << cells_visited
+       << ", \"pixels_written\": " << pixels_written
+       << ", \"bytes_encoded\": " << bytes_encoded;
+  }
+};
+
+// adds the time between construction and destruction to one stage
+class StageTimer {
+public:
+  StageTimer(FrameStats &stats, Stage stage)
+      : slot(stats.time(stage)), start(std::chrono::steady_clock::now()) {}
+  ~StageTimer() {
+    slot += std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                          start)
+                .count();
+  }
+
+private:
+  double &slot;
+  std::chrono::steady_clock::time_point start;
+};
+
+// one row per (frame, source) to a .csv file, or a JSON array for any
+// other name. source is what produced the stats, e.g. a Window's name();
+// player is -1 when the row belongs to no player
+class FrameTrace {
+public:
+  explicit FrameTrace(const std::string &path)
+      : out(path), csv(path.size() >= 4 &&
+                       path.compare(path.size() - 4, 4, ".csv") == 0) {
+    if (csv)
+      out << "frame,source,player," << FrameStats::csv_header() << "\n";
+    else
+      out << "[";
+  }
+  ~FrameTrace() {
+    if (!csv)
+      out << "\n]\n";
+  }
+  void record(size_t frame, const std::string &source, long player,
+              const FrameStats &stats) {
+    if (csv) {
+      out << frame << "," << source << "," << player << ",";
+      stats.to_csv(out);
+      out << "\n";
+    } else {
+      out << (rows ? ",\n" : "\n") << "  {\"frame\": " << frame
+          << ", \"source\": \"" << source << "\", \"player\": " << player
+          << ", ";
+      stats.to_json(out);
+      out << "}";
+    }
+    rows++;
+  }
+
+private:
+  std::ofstream out;
+  bool csv;
+  size_t rows = 0;
+};
@@ -0,0 +1,134 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "encoder.h"
+#include "frame_layout.h"
+
+// QOI (qoiformat.org): every pixel becomes a run, an index into the 64
+// colors seen last, a small difference to the previous pixel or the color
+// itself, 1 to 4 bytes. flat wall slices are runs, gradients differences.
+// alpha is dropped as in the PPM, the file has 3 channels
+class QoiEncoder {
+public:
+  size_t chunk_pixels = 1 << 16; // converted and encoded at a time
+
+  // streams the file to out(const uint8_t *, size_t), a band of rows at a
+  // time, straight from the frame's pixels; false when out fails
+  template <typename Out>
+  bool encode(const uint32_t *buffer, const FrameLayout &layout, Out out) {
+    static const uint8_t end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    const size_t w = layout.w, h = layout.h;
+    const size_t rows =
+        std::max<size_t>(1, chunk_pixels / std::max<size_t>(w, 1));
+    // at most a run's end and a color per pixel, then the end marker
+    bytes.resize(header_size + 5 * rows * w + 1 + sizeof(end_marker));
+    uint8_t *p = bytes.data();
+    memcpy(p, "qoif", 4);
+    put32(p + 4, uint32_t(w));
+    put32(p + 8, uint32_t(h));
+    p[12] = 3; // rgb
+    p[13] = 0; // srgb
+    p += header_size;
+
+    uint32_t index[64] = {0};
+    uint32_t prev = 0xFF000000;
+    size_t run = 0;
+    for (size_t y = 0; y < h; y += rows) {
+      size_t y1 = std::min(h, y + rows);
+      const uint32_t *px = layout.row_major(buffer, y, y1, scratch);
+      for (size_t i = 0, n = (y1 - y) * w; i < n; i++) {
+        uint32_t c = px[i] | 0xFF000000;
+        if (c == prev) {
+          if (++run == 62) {
+            *p++ = uint8_t(0xC0 | (run - 1));
+            run = 0;
+          }
+          continue;
+        }
+        if (run) {
+          *p++ = uint8_t(0xC0 | (run - 1));
+          run = 0;
+        }
+        uint8_t r = c, g = c >> 8, b = c >> 16;
+        size_t slot = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+        if (index[slot] == c) {
+          *p++ = uint8_t(slot);
+        } else {
+          index[slot] = c;
+          // differences wrap around, as 8-bit channels do
+          int8_t dr = int8_t(r - uint8_t(prev)),
+                 dg = int8_t(g - uint8_t(prev >> 8)),
+                 db = int8_t(b - uint8_t(prev >> 16));
+          int8_t dr_dg = int8_t(dr - dg), db_dg = int8_t(db - dg);
+          if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 &&
+              db <= 1) {
+            *p++ = uint8_t(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+          } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+                     db_dg >= -8 && db_dg <= 7) {
+            *p++ = uint8_t(0x80 | (dg + 32));
+            *p++ = uint8_t((dr_dg + 8) << 4 | (db_dg + 8));
+          } else {
+            *p++ = 0xFE;
+            *p++ = r;
+            *p++ = g;
+            *p++ = b;
+          }
+        }
+        prev = c;
+      }
+      if (y1 < h) {
+        if (!out(bytes.data(), size_t(p - bytes.data())))
+          return false;
+        p = bytes.data();
+      }
+    }
+    if (run)
+      *p++ = uint8_t(0xC0 | (run - 1));
+    memcpy(p, end_marker, sizeof(end_marker));
+    p += sizeof(end_marker);
+    return out(bytes.data(), size_t(p - bytes.data()));
+  }
+
+  // the whole file in memory
+  std::vector<uint8_t> encode(const uint32_t *buffer,
+                              const FrameLayout &layout) {
+    std::vector<uint8_t> file;
+    encode(buffer, layout, [&](const uint8_t *data, size_t n) {
+      file.insert(file.end(), data, data + n);
+      return true;
+    });
+    return file;
+  }
+
+  bool write(const std::string &filename, const uint32_t *buffer,
+             const FrameLayout &layout) {
+    FileOutput file;
+    if (!file.open(filename))
+      return false;
+    bool ok = encode(buffer, layout, [&](const uint8_t *data, size_t n) {
+      return file.write(data, n);
+    });
+    return file.close() && ok;
+  }
+
+private:
+  static const size_t header_size = 14;
+  std::vector<uint8_t> bytes;     // the band being encoded, reused
+  std::vector<uint32_t> scratch; // rows brought into row order
+
+  static void put32(uint8_t *p, uint32_t v) { // big endian
+    p[0] = uint8_t(v >> 24);
+    p[1] = uint8_t(v >> 16);
+    p[2] = uint8_t(v >> 8);
+    p[3] = uint8_t(v);
+  }
+};
+
+inline bool write_qoi(const std::string &filename, const uint32_t *buffer,
+                      const FrameLayout &layout) {
+  QoiEncoder encoder;
+  return encoder.write(filename, buffer, layout);
+}
@@ -0,0 +1,489 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "raycast.h"
+#include "simd.h"
+
+// the map as the vector kernels read it: the cell characters as they are,
+// followed by at least `padding` readable bytes so a 4-byte gather at the
+// last cell stays in bounds. map files are laid out like that and are read
+// in place (view), any other matrix is copied once. copies of a PacketGrid
+// share the cells
+class PacketGrid {
+public:
+  enum : size_t { padding = 4 };
+  const char *cells = nullptr;
+  size_t w = 0;
+  size_t h = 0;
+  PacketGrid() {}
+  PacketGrid(const char *matrix, size_t w, size_t h)
+      : w(w), h(h),
+        copy(std::make_shared<std::vector<char>>(matrix, matrix + w * h)) {
+    copy->resize(w * h + padding, '0');
+    cells = copy->data();
+  }
+  // matrix must be followed by padding readable bytes
+  static PacketGrid view(const char *matrix, size_t w, size_t h) {
+    PacketGrid grid;
+    grid.cells = matrix;
+    grid.w = w;
+    grid.h = h;
+    return grid;
+  }
+
+private:
+  std::shared_ptr<std::vector<char>> copy;
+};
+
+// how the rays of a view spread over its field of view
+enum class Projection {
+  Angular, // the same angle between neighbours; distances along the ray
+  Planar,  // evenly spaced on a camera plane; distances are depths, so wall
+           // slices come out without the fisheye bulge
+};
+
+// the directions of a view's n rays, the first at angle a, the view
+// spanning fov. what doesn't depend on a is kept until fov, n or the
+// projection change, so a frame costs one sin/cos and a few multiply-adds
+// per ray, and ray i sits at i * fov / n exactly instead of at a sum of
+// steps that drifts
+class ViewTable {
+public:
+  void set(float fov, size_t n, Projection projection = Projection::Angular) {
+    if (fov == this->fov && n == off_x.size() &&
+        projection == this->projection)
+      return;
+    this->fov = fov;
+    this->projection = projection;
+    off_x.resize(n);
+    off_y.resize(n);
+    if (projection == Projection::Planar)
+      return; // nothing to precompute, see directions()
+    for (size_t i = 0; i < n; i++) {
+      double o = double(i) * fov / n;
+      off_x[i] = float(std::cos(o));
+      off_y[i] = float(std::sin(o));
+    }
+  }
+  size_t size() const { return off_x.size(); }
+
+  void directions(float a, float *dir_x, float *dir_y) const {
+    const size_t n = size();
+    if (projection == Projection::Planar) {
+      // the unit vector to the view's center plus a multiple of the camera
+      // plane, which is tan(fov / 2) long either way; for ray i the
+      // multiple is 2i / n - 1
+      float center = a + fov / 2;
+      float fx = std::cos(center), fy = std::sin(center);
+      float half = std::tan(fov / 2);
+      float plane_x = -fy * half, plane_y = fx * half;
+      float base_x = fx - plane_x, base_y = fy - plane_y;
+      float step_x = 2 * plane_x / n, step_y = 2 * plane_y / n;
+      for (int i = 0; i < int(n); i++) { // int converts to float in vectors
+        dir_x[i] = base_x + float(i) * step_x;
+        dir_y[i] = base_y + float(i) * step_y;
+      }
+      return;
+    }
+    // the offsets rotated by a
+    float ca = std::cos(a), sa = std::sin(a);
+    for (size_t i = 0; i < n; i++) {
+      dir_x[i] = off_x[i] * ca - off_y[i] * sa;
+      dir_y[i] = off_x[i] * sa + off_y[i] * ca;
+    }
+  }
+
+private:
+  float fov = 0;
+  Projection projection = Projection::Angular;
+  std::vector<float> off_x; // angular: cos and sin of the ray's angle
+  std::vector<float> off_y; // relative to the first
+};
+
+// a batch of rays sharing one origin, stored as structure of arrays.
+// inputs: dir_x/dir_y. outputs: everything else, one entry per ray
+class RayPacket {
+public:
+  std::vector<float> dir_x;
+  std::vector<float> dir_y;
+  std::vector<float> dis; // unit: grid
+  std::vector<int32_t> cell_x;
+  std::vector<int32_t> cell_y;
+  std::vector<int32_t> material; // the wall's palette index, 0: no hit
+  std::vector<uint8_t> side;     // WallSide
+  std::vector<uint32_t> color;   // palette[material], black for a miss
+  TRC_PROFILE_ONLY(std::vector<uint32_t> steps; std::vector<uint32_t> cells;)
+
+  size_t size() const { return dir_x.size(); }
+  void resize(size_t n) {
+    dir_x.resize(n);
+    dir_y.resize(n);
+    dis.resize(n);
+    cell_x.resize(n);
+    cell_y.resize(n);
+    material.resize(n);
+    side.resize(n);
+    color.resize(n);
+    TRC_PROFILE_ONLY(steps.resize(n); cells.resize(n);)
+  }
+  // n rays starting at angle a, step apart (the fan of a view)
+  void set_fan(float a, float step, size_t n) {
+    resize(n);
+    for (size_t i = 0; i < n; i++) {
+      dir_x[i] = cos(a + float(i) * step);
+      dir_y[i] = sin(a + float(i) * step);
+    }
+  }
+  // the rays of a view whose first ray points at angle a
+  void set_view(const ViewTable &view, float a) {
+    resize(view.size());
+    view.directions(a, dir_x.data(), dir_y.data());
+  }
+};
+
+namespace packet_detail {
+
+TRC_ALWAYS_INLINE void store_result(RayPacket &p, size_t i,
+                                    const RayHit &hit) {
+  p.dis[i] = hit.dis;
+  p.cell_x[i] = hit.cell_x;
+  p.cell_y[i] = hit.cell_y;
+  p.material[i] = hit.hit ? hit.cell - '0' : 0;
+  p.side[i] = uint8_t(hit.side);
+  TRC_PROFILE_ONLY(p.steps[i] = hit.steps; p.cells[i] = hit.cells;)
+}
+
+// the scalar fallback and the tail of the vector kernels
+template <typename Shape>
+inline void cast_range_scalar(const Shape &shape, const char *matrix, float x,
+                              float y, RayPacket &p, size_t begin, size_t end,
+                              float max_dis) {
+  for (size_t i = begin; i < end; i++)
+    store_result(p, i,
+                 raycast_detail::trace(shape, matrix, x, y, p.dir_x[i],
+                                       p.dir_y[i], max_dis,
+                                       raycast_detail::SingleStep()));
+}
+
+#if TRC_X86_SIMD
+// both kernels run the same steps as cast_ray_dir, lane by lane, and
+// produce bit-identical distances (same operations, no fma). Shift >= 0:
+// the map is 1 << Shift cells wide, so a cell's row offset is a shift
+// instead of a multiply (a 10-cycle one on the path of every step)
+
+template <int Shift>
+TRC_TARGET("avx2")
+inline size_t cast_avx2(const PacketGrid &grid, float x, float y,
+                        RayPacket &p, size_t begin, size_t end,
+                        float max_dis) {
+  const int map_x0 = int(std::floor(x));
+  const int map_y0 = int(std::floor(y));
+  const __m256 px = _mm256_set1_ps(x), py = _mm256_set1_ps(y);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+  const __m256 vmax = _mm256_set1_ps(max_dis);
+  const __m256i izero = _mm256_setzero_si256();
+  const __m256i ione = _mm256_set1_epi32(1);
+  const __m256i gw = _mm256_set1_epi32(int(grid.w));
+  const __m256i gh = _mm256_set1_epi32(int(grid.h));
+  const __m256i west = _mm256_set1_epi32(int(WallSide::West));
+  const __m256i east = _mm256_set1_epi32(int(WallSide::East));
+  const __m256i north = _mm256_set1_epi32(int(WallSide::North));
+  const __m256i south = _mm256_set1_epi32(int(WallSide::South));
+  const __m256i byte = _mm256_set1_epi32(255);
+  const __m256i empty = _mm256_set1_epi32('0');
+  const int *cells = (const int *)grid.cells;
+
+  size_t i = begin;
+  for (; i + 8 <= end; i += 8) {
+    __m256 dx = _mm256_loadu_ps(&p.dir_x[i]);
+    __m256 dy = _mm256_loadu_ps(&p.dir_y[i]);
+    __m256 pos_x = _mm256_cmp_ps(dx, zero, _CMP_GT_OQ);
+    __m256 neg_x = _mm256_cmp_ps(dx, zero, _CMP_LT_OQ);
+    __m256 pos_y = _mm256_cmp_ps(dy, zero, _CMP_GT_OQ);
+    __m256 neg_y = _mm256_cmp_ps(dy, zero, _CMP_LT_OQ);
+    __m256 moves_x = _mm256_or_ps(pos_x, neg_x);
+    __m256 moves_y = _mm256_or_ps(pos_y, neg_y);
+    // step = +1 / -1 / 0, as integers
+    __m256i step_x = _mm256_sub_epi32(
+        _mm256_and_si256(_mm256_castps_si256(pos_x), ione),
+        _mm256_and_si256(_mm256_castps_si256(neg_x), ione));
+    __m256i step_y = _mm256_sub_epi32(
+        _mm256_and_si256(_mm256_castps_si256(pos_y), ione),
+        _mm256_and_si256(_mm256_castps_si256(neg_y), ione));
+    __m256 inv_x = _mm256_div_ps(one, dx);
+    __m256 inv_y = _mm256_div_ps(one, dy);
+    __m256i map_x = _mm256_set1_epi32(map_x0);
+    __m256i map_y = _mm256_set1_epi32(map_y0);
+    __m256i next_x = _mm256_add_epi32(
+        map_x, _mm256_and_si256(_mm256_castps_si256(pos_x), ione));
+    __m256i next_y = _mm256_add_epi32(
+        map_y, _mm256_and_si256(_mm256_castps_si256(pos_y), ione));
+    __m256i side_x = _mm256_blendv_epi8(east, west, _mm256_castps_si256(pos_x));
+    __m256i side_y =
+        _mm256_blendv_epi8(south, north, _mm256_castps_si256(pos_y));
+
+    __m256 out_dis = vmax;
+    __m256i out_cx = _mm256_set1_epi32(-1), out_cy = out_cx;
+    __m256i out_mat = izero, out_side = izero;
+    __m256i active = _mm256_set1_epi32(-1);
+    TRC_PROFILE_ONLY(__m256i steps = izero; __m256i visits = izero;)
+
+    while (!_mm256_testz_si256(active, active)) {
+      TRC_PROFILE_ONLY(steps = _mm256_sub_epi32(steps, active);) // -1: active
+      __m256 tx = _mm256_blendv_ps(
+          inf,
+          _mm256_mul_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(next_x), px), inv_x),
+          moves_x);
+      __m256 ty = _mm256_blendv_ps(
+          inf,
+          _mm256_mul_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(next_y), py), inv_y),
+          moves_y);
+      __m256i take_x = _mm256_castps_si256(_mm256_cmp_ps(tx, ty, _CMP_LT_OQ));
+      __m256i take_y = _mm256_andnot_si256(take_x, _mm256_set1_epi32(-1));
+      __m256 t = _mm256_blendv_ps(ty, tx, _mm256_castsi256_ps(take_x));
+      __m256i dsx = _mm256_and_si256(take_x, step_x);
+      __m256i dsy = _mm256_and_si256(take_y, step_y);
+      map_x = _mm256_add_epi32(map_x, dsx);
+      next_x = _mm256_add_epi32(next_x, dsx);
+      map_y = _mm256_add_epi32(map_y, dsy);
+      next_y = _mm256_add_epi32(next_y, dsy);
+      __m256i side = _mm256_blendv_epi8(side_y, side_x, take_x);
+
+      __m256i out = _mm256_or_si256(
+          _mm256_castps_si256(_mm256_cmp_ps(t, vmax, _CMP_GT_OQ)),
+          _mm256_or_si256(
+              _mm256_or_si256(_mm256_cmpgt_epi32(izero, map_x),
+                              _mm256_cmpgt_epi32(izero, map_y)),
+              _mm256_or_si256(
+                  _mm256_xor_si256(_mm256_cmpgt_epi32(gw, map_x),
+                                   _mm256_set1_epi32(-1)),
+                  _mm256_xor_si256(_mm256_cmpgt_epi32(gh, map_y),
+                                   _mm256_set1_epi32(-1)))));
+      __m256i missed = _mm256_and_si256(active, out);
+      __m256i inside = _mm256_andnot_si256(out, active);
+      __m256i index = _mm256_add_epi32(
+          map_x, Shift >= 0 ? _mm256_slli_epi32(map_y, Shift < 0 ? 0 : Shift)
+                            : _mm256_mullo_epi32(map_y, gw));
+      // 4 bytes from the cell on, keep the first: the cell's character
+      __m256i cell = _mm256_sub_epi32(
+          _mm256_and_si256(
+              _mm256_mask_i32gather_epi32(izero, cells, index, inside, 1),
+              byte),
+          empty);
+      __m256i hit = _mm256_andnot_si256(_mm256_cmpeq_epi32(cell, izero),
+                                        inside);
+      TRC_PROFILE_ONLY(visits = _mm256_sub_epi32(visits, inside);)
+
+      out_dis = _mm256_blendv_ps(out_dis, t, _mm256_castsi256_ps(hit));
+      out_cx = _mm256_blendv_epi8(out_cx, map_x, hit);
+      out_cy = _mm256_blendv_epi8(out_cy, map_y, hit);
+      out_mat = _mm256_blendv_epi8(out_mat, cell, hit);
+      out_side = _mm256_blendv_epi8(out_side, side, hit);
+      active = _mm256_andnot_si256(_mm256_or_si256(missed, hit), active);
+    }
+    _mm256_storeu_ps(&p.dis[i], out_dis);
+    _mm256_storeu_si256((__m256i *)&p.cell_x[i], out_cx);
+    _mm256_storeu_si256((__m256i *)&p.cell_y[i], out_cy);
+    _mm256_storeu_si256((__m256i *)&p.material[i], out_mat);
+    TRC_PROFILE_ONLY(_mm256_storeu_si256((__m256i *)&p.steps[i], steps);
+                     _mm256_storeu_si256((__m256i *)&p.cells[i], visits);)
+    alignas(32) int32_t sides[8];
+    _mm256_store_si256((__m256i *)sides, out_side);
+    for (int k = 0; k < 8; k++)
+      p.side[i + k] = uint8_t(sides[k]);
+  }
+  return i;
+}
+
+template <int Shift>
+TRC_TARGET("sse4.1")
+inline size_t cast_sse41(const PacketGrid &grid, float x, float y,
+                         RayPacket &p, size_t begin, size_t end,
+                         float max_dis) {
+  const int map_x0 = int(std::floor(x));
+  const int map_y0 = int(std::floor(y));
+  const __m128 px = _mm_set1_ps(x), py = _mm_set1_ps(y);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+  const __m128 vmax = _mm_set1_ps(max_dis);
+  const __m128i izero = _mm_setzero_si128();
+  const __m128i ione = _mm_set1_epi32(1);
+  const __m128i all = _mm_set1_epi32(-1);
+  const __m128i gw = _mm_set1_epi32(int(grid.w));
+  const __m128i gh = _mm_set1_epi32(int(grid.h));
+  const char *cells = grid.cells;
+
+  size_t i = begin;
+  for (; i + 4 <= end; i += 4) {
+    __m128 dx = _mm_loadu_ps(&p.dir_x[i]);
+    __m128 dy = _mm_loadu_ps(&p.dir_y[i]);
+    __m128 pos_x = _mm_cmpgt_ps(dx, zero), neg_x = _mm_cmplt_ps(dx, zero);
+    __m128 pos_y = _mm_cmpgt_ps(dy, zero), neg_y = _mm_cmplt_ps(dy, zero);
+    __m128 moves_x = _mm_or_ps(pos_x, neg_x);
+    __m128 moves_y = _mm_or_ps(pos_y, neg_y);
+    __m128i step_x =
+        _mm_sub_epi32(_mm_and_si128(_mm_castps_si128(pos_x), ione),
+                      _mm_and_si128(_mm_castps_si128(neg_x), ione));
+    __m128i step_y =
+        _mm_sub_epi32(_mm_and_si128(_mm_castps_si128(pos_y), ione),
+                      _mm_and_si128(_mm_castps_si128(neg_y), ione));
+    __m128 inv_x = _mm_div_ps(one, dx);
+    __m128 inv_y = _mm_div_ps(one, dy);
+    __m128i map_x = _mm_set1_epi32(map_x0);
+    __m128i map_y = _mm_set1_epi32(map_y0);
+    __m128i next_x =
+        _mm_add_epi32(map_x, _mm_and_si128(_mm_castps_si128(pos_x), ione));
+    __m128i next_y =
+        _mm_add_epi32(map_y, _mm_and_si128(_mm_castps_si128(pos_y), ione));
+    __m128i side_x = _mm_blendv_epi8(_mm_set1_epi32(int(WallSide::East)),
+                                     _mm_set1_epi32(int(WallSide::West)),
+                                     _mm_castps_si128(pos_x));
+    __m128i side_y = _mm_blendv_epi8(_mm_set1_epi32(int(WallSide::South)),
+                                     _mm_set1_epi32(int(WallSide::North)),
+                                     _mm_castps_si128(pos_y));
+
+    __m128 out_dis = vmax;
+    __m128i out_cx = all, out_cy = all;
+    __m128i out_mat = izero, out_side = izero;
+    __m128i active = all;
+    TRC_PROFILE_ONLY(__m128i steps = izero; __m128i visits = izero;)
+
+    while (!_mm_testz_si128(active, active)) {
+      TRC_PROFILE_ONLY(steps = _mm_sub_epi32(steps, active);) // -1: active
+      __m128 tx = _mm_blendv_ps(
+          inf, _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(next_x), px), inv_x),
+          moves_x);
+      __m128 ty = _mm_blendv_ps(
+          inf, _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(next_y), py), inv_y),
+          moves_y);
+      __m128i take_x = _mm_castps_si128(_mm_cmplt_ps(tx, ty));
+      __m128i take_y = _mm_andnot_si128(take_x, all);
+      __m128 t = _mm_blendv_ps(ty, tx, _mm_castsi128_ps(take_x));
+      __m128i dsx = _mm_and_si128(take_x, step_x);
+      __m128i dsy = _mm_and_si128(take_y, step_y);
+      map_x = _mm_add_epi32(map_x, dsx);
+      next_x = _mm_add_epi32(next_x, dsx);
+      map_y = _mm_add_epi32(map_y, dsy);
+      next_y = _mm_add_epi32(next_y, dsy);
+      __m128i side = _mm_blendv_epi8(side_y, side_x, take_x);
+
+      __m128i out = _mm_or_si128(
+          _mm_castps_si128(_mm_cmpgt_ps(t, vmax)),
+          _mm_or_si128(_mm_or_si128(_mm_cmplt_epi32(map_x, izero),
+                                    _mm_cmplt_epi32(map_y, izero)),
+                       _mm_or_si128(_mm_xor_si128(_mm_cmpgt_epi32(gw, map_x), all),
+                                    _mm_xor_si128(_mm_cmpgt_epi32(gh, map_y), all))));
+      __m128i missed = _mm_and_si128(active, out);
+      __m128i inside = _mm_andnot_si128(out, active);
+      // no gather below avx2, look the cells up one lane at a time
+      alignas(16) int32_t index[4], in[4], cell_lanes[4];
+      _mm_store_si128((__m128i *)index,
+                      _mm_add_epi32(
+                          map_x, Shift >= 0
+                                     ? _mm_slli_epi32(map_y, Shift < 0 ? 0 : Shift)
+                                     : _mm_mullo_epi32(map_y, gw)));
+      _mm_store_si128((__m128i *)in, inside);
+      for (int k = 0; k < 4; k++)
+        cell_lanes[k] = in[k] ? cells[index[k]] - '0' : 0;
+      __m128i cell = _mm_load_si128((const __m128i *)cell_lanes);
+      __m128i hit = _mm_andnot_si128(_mm_cmpeq_epi32(cell, izero), inside);
+      TRC_PROFILE_ONLY(visits = _mm_sub_epi32(visits, inside);)
+
+      out_dis = _mm_blendv_ps(out_dis, t, _mm_castsi128_ps(hit));
+      out_cx = _mm_blendv_epi8(out_cx, map_x, hit);
+      out_cy = _mm_blendv_epi8(out_cy, map_y, hit);
+      out_mat = _mm_blendv_epi8(out_mat, cell, hit);
+      out_side = _mm_blendv_epi8(out_side, side, hit);
+      active = _mm_andnot_si128(_mm_or_si128(missed, hit), active);
+    }
+    _mm_storeu_ps(&p.dis[i], out_dis);
+    _mm_storeu_si128((__m128i *)&p.cell_x[i], out_cx);
+    _mm_storeu_si128((__m128i *)&p.cell_y[i], out_cy);
+    _mm_storeu_si128((__m128i *)&p.material[i], out_mat);
+    TRC_PROFILE_ONLY(_mm_storeu_si128((__m128i *)&p.steps[i], steps);
+                     _mm_storeu_si128((__m128i *)&p.cells[i], visits);)
+    alignas(16) int32_t sides[4];
+    _mm_store_si128((__m128i *)sides, out_side);
+    for (int k = 0; k < 4; k++)
+      p.side[i + k] = uint8_t(sides[k]);
+  }
+  return i;
+}
+#endif
+
+// cast_packet on a map of the given shape, Shift as for the kernels
+template <int Shift, typename Shape>
+inline void cast_range(const Shape &shape, const char *matrix,
+                       const PacketGrid &grid, float x, float y, RayPacket &p,
+                       const uint32_t *palette, size_t begin, size_t end,
+                       float max_dis, SimdLevel level) {
+  size_t done = begin;
+#if TRC_X86_SIMD
+  int map_x = int(std::floor(x)), map_y = int(std::floor(y));
+  bool simple_start = shape.contains(map_x, map_y) &&
+                      grid.cells[shape.index(map_x, map_y)] == '0';
+  if (simple_start && level == SimdLevel::AVX2)
+    done = cast_avx2<Shift>(grid, x, y, p, begin, end, max_dis);
+  else if (simple_start && level == SimdLevel::SSE41)
+    done = cast_sse41<Shift>(grid, x, y, p, begin, end, max_dis);
+#else
+  (void)level;
+#endif
+  cast_range_scalar(shape, matrix, x, y, p, done, end, max_dis);
+  const uint32_t black = 0xFF000000;
+  for (size_t i = begin; i < end; i++)
+    p.color[i] = p.material[i] ? palette[p.material[i]] : black;
+}
+
+} // namespace packet_detail
+
+// trace the rays [begin,end) of the packet from (x,y). the vector kernels
+// are used when the CPU has them and the origin is an empty cell inside the
+// map; anything left over (the tail, odd starts) goes through the scalar
+// traversal. palette: the wall colors, indexed by material.
+// disjoint ranges of one packet can be cast from different threads
+inline void cast_packet(const char *matrix, const PacketGrid &grid, float x,
+                        float y, RayPacket &p, const uint32_t *palette,
+                        size_t begin, size_t end, float max_dis = 20,
+                        SimdLevel level = simd_level()) {
+  packet_detail::cast_range<-1>(raycast_detail::GridShape{grid.w, grid.h},
+                                matrix, grid, x, y, p, palette, begin, end,
+                                max_dis, level);
+}
+
+// the same on a grid of W x H cells fixed when compiling (grid.w == W,
+// grid.h == H): constant bounds, and shifts for power-of-two widths
+template <size_t W, size_t H>
+inline void cast_packet(const PacketGrid &grid, float x, float y, RayPacket &p,
+                        const uint32_t *palette, size_t begin, size_t end,
+                        float max_dis = 20, SimdLevel level = simd_level()) {
+  typedef raycast_detail::StaticGridShape<W, H> Shape;
+  packet_detail::cast_range<Shape::shift>(Shape(), grid.cells, grid, x, y, p,
+                                          palette, begin, end, max_dis, level);
+}
+
+// the rays [begin,end) one at a time through cast(dir_x, dir_y) -> RayHit,
+// for traversals the vector kernels don't cover
+template <typename Cast>
+inline void cast_packet_each(RayPacket &p, const uint32_t *palette,
+                             size_t begin, size_t end, Cast cast) {
+  const uint32_t black = 0xFF000000;
+  for (size_t i = begin; i < end; i++) {
+    packet_detail::store_result(p, i, cast(p.dir_x[i], p.dir_y[i]));
+    p.color[i] = p.material[i] ? palette[p.material[i]] : black;
+  }
+}
+
+// the whole packet
+inline void cast_packet(const char *matrix, const PacketGrid &grid, float x,
+                        float y, RayPacket &p, const uint32_t *palette,
+                        float max_dis = 20, SimdLevel level = simd_level()) {
+  cast_packet(matrix, grid, x, y, p, palette, 0, p.size(), max_dis, level);
+}
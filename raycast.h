@@ -0,0 +1,257 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include "profile.h"
+
+// the face of the wall cell that the ray ran into
+// (y grows downwards, so North is the top face of a cell)
+enum class WallSide : uint8_t { None, North, South, East, West };
+
+struct RayHit {
+  float dis = 0;   // unit: grid, exact distance to the wall face
+  int cell_x = -1; // the wall cell that stopped the ray
+  int cell_y = -1;
+  WallSide side = WallSide::None;
+  char cell = '0'; // the value of the wall cell in the matrix
+  bool hit = false; // false: nothing within max_dis (or the ray left the map)
+  TRC_PROFILE_ONLY(uint32_t steps = 0; uint32_t cells = 0;)
+};
+
+// for the few functions every step of a ray runs. gcc stops inlining
+// them into callers that have grown large, e.g. ones a whole fixed-size
+// trace was inlined into, and a call per step costs more than the step
+#if defined(__GNUC__)
+#define TRC_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define TRC_ALWAYS_INLINE inline
+#endif
+
+namespace raycast_detail {
+
+// the traversal state of one ray: the cell it is in and the next grid line
+// it will cross on each axis
+struct Dda {
+  float x, y;
+  float dir_x, dir_y;
+  int step_x, step_y;
+  float inv_x, inv_y;
+  int map_x, map_y;
+  int next_x, next_y;
+
+  TRC_ALWAYS_INLINE Dda(float x, float y, float dir_x, float dir_y)
+      : x(x), y(y), dir_x(dir_x), dir_y(dir_y), step_x(dir_x > 0 ? 1 : (dir_x < 0 ? -1 : 0)),
+        step_y(dir_y > 0 ? 1 : (dir_y < 0 ? -1 : 0)),
+        inv_x(step_x ? 1.0f / dir_x : 0), inv_y(step_y ? 1.0f / dir_y : 0),
+        map_x(int(std::floor(x))), map_y(int(std::floor(y))),
+        next_x(step_x > 0 ? map_x + 1 : map_x),
+        next_y(step_y > 0 ? map_y + 1 : map_y) {}
+
+  // distances are derived from the grid line index instead of being
+  // accumulated, so they carry no drift however long the ray gets
+  TRC_ALWAYS_INLINE float t_x(int line) const {
+    return step_x ? (float(line) - x) * inv_x
+                  : std::numeric_limits<float>::infinity();
+  }
+  TRC_ALWAYS_INLINE float t_y(int line) const {
+    return step_y ? (float(line) - y) * inv_y
+                  : std::numeric_limits<float>::infinity();
+  }
+
+  // crosses the nearest grid line (ties go to y), returns the distance
+  TRC_ALWAYS_INLINE float step(WallSide &side) {
+    float tx = t_x(next_x), ty = t_y(next_y);
+    if (tx < ty) {
+      map_x += step_x;
+      next_x += step_x;
+      side = step_x > 0 ? WallSide::West : WallSide::East;
+      return tx;
+    }
+    map_y += step_y;
+    next_y += step_y;
+    side = step_y > 0 ? WallSide::North : WallSide::South;
+    return ty;
+  }
+
+  // leaves the box [x0,x1)x[y0,y1) of empty cells around the current cell
+  // at once. ends up exactly where repeated step()s would after crossing the
+  // box's edge: the lines crossed on the other axis on the way are counted
+  // with the same formula step() compares
+  float skip_box(int x0, int y0, int x1, int y1, WallSide &side) {
+    if (!step_x && !step_y)
+      return step(side);
+    int edge_x = step_x > 0 ? x1 : x0, edge_y = step_y > 0 ? y1 : y0;
+    float tx = t_x(edge_x), ty = t_y(edge_y);
+    if (tx < ty) {
+      next_y = first_line_after(tx, y, dir_y, inv_y, step_y, next_y, edge_y,
+                                true);
+      map_y = step_y > 0 ? next_y - 1 : next_y;
+      map_x = step_x > 0 ? edge_x : edge_x - 1;
+      next_x = edge_x + step_x;
+      side = step_x > 0 ? WallSide::West : WallSide::East;
+      return tx;
+    }
+    next_x = first_line_after(ty, x, dir_x, inv_x, step_x, next_x, edge_x,
+                              false);
+    map_x = step_x > 0 ? next_x - 1 : next_x;
+    map_y = step_y > 0 ? edge_y : edge_y - 1;
+    next_y = edge_y + step_y;
+    side = step_y > 0 ? WallSide::North : WallSide::South;
+    return ty;
+  }
+
+private:
+  // the first line from `from` towards `edge` that step() would not cross
+  // before t, i.e. whose distance is > t (>= t when it loses ties). the
+  // distances grow monotonically along the lines, so a guess from the real
+  // solution only needs nudging by a line or so
+  static int first_line_after(float t, float o, float dir, float inv, int step,
+                              int from, int edge, bool ties_cross) {
+    if (!step)
+      return from;
+    auto crossed = [&](int line) {
+      float tl = (float(line) - o) * inv;
+      return ties_cross ? tl <= t : tl < t;
+    };
+    float real = o + t * dir;
+    int line = step > 0 ? int(std::floor(real)) + 1 : int(std::ceil(real)) - 1;
+    if ((line - from) * step < 0)
+      line = from;
+    if ((line - edge) * step > 0)
+      line = edge;
+    while (line != from && !crossed(line - step))
+      line -= step;
+    while (line != edge && crossed(line))
+      line += step;
+    return line;
+  }
+};
+
+// the size of a map known at run time, and where its cells are
+struct GridShape {
+  size_t w;
+  size_t h;
+  bool contains(int x, int y) const {
+    return x >= 0 && y >= 0 && x < int(w) && y < int(h);
+  }
+  size_t index(int x, int y) const { return x + y * w; }
+};
+
+constexpr int log2_floor(size_t n) { return n > 1 ? 1 + log2_floor(n / 2) : 0; }
+
+// the same for a map whose size is fixed when compiling: the bounds are
+// constants, and a power-of-two width makes the row offset a shift
+template <size_t W, size_t H> struct StaticGridShape {
+  static constexpr size_t w = W;
+  static constexpr size_t h = H;
+  static constexpr bool pow2_w = W > 0 && (W & (W - 1)) == 0;
+  static constexpr int shift = pow2_w ? log2_floor(W) : -1;
+  bool contains(int x, int y) const {
+    // negatives wrap to huge values: one compare per axis
+    return unsigned(x) < unsigned(W) && unsigned(y) < unsigned(H);
+  }
+  size_t index(int x, int y) const {
+    return pow2_w ? size_t(x) + (size_t(y) << (pow2_w ? shift : 0))
+                  : size_t(x) + size_t(y) * W;
+  }
+};
+
+// walks from cell to cell with advance(dda, side) -> t until a cell that is
+// not '0', max_dis or the edge of the map. advance may skip several empty
+// cells at once as long as it lands where single steps would
+template <typename Shape, typename Advance>
+inline RayHit trace(const Shape &shape, const char *matrix, float x, float y,
+                    float dir_x, float dir_y, float max_dis, Advance advance) {
+  RayHit hit;
+  Dda dda(x, y, dir_x, dir_y);
+  if (!shape.contains(dda.map_x, dda.map_y)) {
+    hit.dis = max_dis;
+    return hit;
+  }
+  char start = matrix[shape.index(dda.map_x, dda.map_y)];
+  if (start != '0') { // started inside a wall
+    hit.cell_x = dda.map_x;
+    hit.cell_y = dda.map_y;
+    hit.cell = start;
+    hit.hit = true;
+    return hit;
+  }
+
+  for (;;) {
+    TRC_PROFILE_ONLY(hit.steps++;)
+    WallSide side;
+    float t = advance(dda, side);
+    if (t > max_dis)
+      break;
+    if (!shape.contains(dda.map_x, dda.map_y))
+      break;
+    char cell = matrix[shape.index(dda.map_x, dda.map_y)];
+    TRC_PROFILE_ONLY(hit.cells++;)
+    if (cell != '0') {
+      hit.dis = t;
+      hit.cell_x = dda.map_x;
+      hit.cell_y = dda.map_y;
+      hit.side = side;
+      hit.cell = cell;
+      hit.hit = true;
+      return hit;
+    }
+  }
+  hit.dis = max_dis;
+  return hit;
+}
+
+template <typename Advance>
+inline RayHit trace(const char *matrix, size_t grid_w, size_t grid_h, float x,
+                    float y, float dir_x, float dir_y, float max_dis,
+                    Advance advance) {
+  return trace(GridShape{grid_w, grid_h}, matrix, x, y, dir_x, dir_y, max_dis,
+               advance);
+}
+
+// the plain DDA's advance: one cell at a time
+struct SingleStep {
+  float operator()(Dda &dda, WallSide &side) const { return dda.step(side); }
+};
+
+} // namespace raycast_detail
+
+// grid traversal (DDA): walks from cell to cell along the ray, visiting each
+// cell it crosses exactly once, and stops at the first cell that is not '0'.
+// (x,y) is the start point and (dir_x,dir_y) a unit direction, unit: grid
+inline RayHit cast_ray_dir(const char *matrix, size_t grid_w, size_t grid_h,
+                           float x, float y, float dir_x, float dir_y,
+                           float max_dis = 20) {
+  return raycast_detail::trace(matrix, grid_w, grid_h, x, y, dir_x, dir_y,
+                               max_dis, raycast_detail::SingleStep());
+}
+
+// the same on a map of W x H cells fixed when compiling
+template <size_t W, size_t H>
+inline RayHit cast_ray_dir(const char *matrix, float x, float y, float dir_x,
+                           float dir_y, float max_dis = 20) {
+  return raycast_detail::trace(raycast_detail::StaticGridShape<W, H>(), matrix,
+                               x, y, dir_x, dir_y, max_dis,
+                               raycast_detail::SingleStep());
+}
+
+// angle: the angle between the ray and the x-axis
+inline RayHit cast_ray(const char *matrix, size_t grid_w, size_t grid_h,
+                       float x, float y, float angle, float max_dis = 20) {
+  return cast_ray_dir(matrix, grid_w, grid_h, x, y, std::cos(angle),
+                      std::sin(angle), max_dis);
+}
+
+// where a ray from (x,y) along (dir_x,dir_y) hit the face of its wall cell
+// after dis: 0..1 along the face, left to right as the ray sees it (a
+// texture's u)
+inline float wall_u(float x, float y, float dir_x, float dir_y, float dis,
+                    WallSide side) {
+  float along = side == WallSide::West || side == WallSide::East
+                    ? y + dis * dir_y
+                    : x + dis * dir_x;
+  float u = along - std::floor(along);
+  return side == WallSide::East || side == WallSide::North ? 1 - u : u;
+}
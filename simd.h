@@ -0,0 +1,52 @@
+#pragma once
+// compile-time and run-time detection for the x86 SIMD kernels.
+// the kernels are compiled per function (no -mavx2 for the whole target),
+// so one binary runs everywhere and picks the widest path the CPU has
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRC_X86_SIMD 1
+#define TRC_TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define TRC_X86_SIMD 1
+#define TRC_TARGET(isa) // msvc allows intrinsics without target flags
+#include <immintrin.h>
+#include <intrin.h>
+#else
+#define TRC_X86_SIMD 0
+#define TRC_TARGET(isa)
+#endif
+
+enum class SimdLevel { Scalar, SSE41, AVX2 };
+
+inline SimdLevel detect_simd() {
+#if TRC_X86_SIMD && defined(__GNUC__)
+  if (__builtin_cpu_supports("avx2"))
+    return SimdLevel::AVX2;
+  if (__builtin_cpu_supports("sse4.1"))
+    return SimdLevel::SSE41;
+#elif TRC_X86_SIMD
+  int info[4];
+  __cpuid(info, 0);
+  int max_leaf = info[0];
+  __cpuid(info, 1);
+  bool sse41 = (info[2] >> 19) & 1;
+  bool avx = (info[2] >> 28) & 1 && (info[2] >> 27) & 1; // avx + osxsave
+  bool avx2 = false;
+  if (avx && max_leaf >= 7) {
+    bool ymm_enabled = (_xgetbv(0) & 6) == 6; // the os saves ymm registers
+    __cpuidex(info, 7, 0);
+    avx2 = ymm_enabled && ((info[1] >> 5) & 1);
+  }
+  if (avx2)
+    return SimdLevel::AVX2;
+  if (sse41)
+    return SimdLevel::SSE41;
+#endif
+  return SimdLevel::Scalar;
+}
+
+// detected once, then cached
+inline SimdLevel simd_level() {
+  static const SimdLevel level = detect_simd();
+  return level;
+}
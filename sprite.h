@@ -0,0 +1,141 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ray_packet.h"
+
+// things standing in the map that are drawn as billboards (other players,
+// items), as parallel arrays so a view transforms all of them in one loop.
+// version() changes with every edit, for Window::input_version
+class SpriteSet {
+public:
+  // (x,y): the center of the footprint, unit: grid. size: height and width,
+  // 1 is as tall as a wall
+  size_t add(float x, float y, float size, uint32_t color) {
+    xs.push_back(x);
+    ys.push_back(y);
+    sizes.push_back(size);
+    colors.push_back(color);
+    edits++;
+    return xs.size() - 1;
+  }
+  void move(size_t i, float x, float y) {
+    xs[i] = x;
+    ys[i] = y;
+    edits++;
+  }
+  void clear() {
+    xs.clear();
+    ys.clear();
+    sizes.clear();
+    colors.clear();
+    edits++;
+  }
+
+  size_t count() const { return xs.size(); }
+  float x(size_t i) const { return xs[i]; }
+  float y(size_t i) const { return ys[i]; }
+  float size(size_t i) const { return sizes[i]; }
+  uint32_t color(size_t i) const { return colors[i]; }
+  uint64_t version() const { return edits; }
+
+private:
+  friend class SpriteView;
+  std::vector<float> xs;
+  std::vector<float> ys;
+  std::vector<float> sizes;
+  std::vector<uint32_t> colors;
+  uint64_t edits = 0;
+};
+
+// a sprite as one view sees it
+struct ProjectedSprite {
+  float depth;  // comparable with the distances of the view's rays
+  float center; // unit: columns, ray i is column i, may lie off the view
+  float half_w; // unit: columns
+  long top;     // rows [top, bottom), the bottom on the floor
+  long bottom;
+  uint32_t color;
+
+  // the first column and one past the last whose rays pass through it
+  long x0() const { return long(std::ceil(center - half_w)); }
+  long x1() const { return long(std::floor(center + half_w)) + 1; }
+};
+
+// the sprites of a set that a view can see, far to near, refreshed once per
+// frame with project(). the transform runs over the whole set at once; what
+// lies behind the viewer, closer than near_dis, past max_dis or beside the
+// view is dropped before sorting
+class SpriteView {
+public:
+  // unit: grid. closer sprites are dropped, the viewer's own among them
+  static constexpr float near_dis = 0.1f;
+
+  // the view of FPV: its first ray at angle a from (x,y), w columns over
+  // fov, h rows
+  void project(const SpriteSet &set, float x, float y, float a, float fov,
+               Projection projection, size_t w, size_t h, float max_dis) {
+    const size_t n = set.count();
+    ahead.resize(n);
+    side.resize(n);
+    float center = a + fov / 2;
+    float fx = std::cos(center), fy = std::sin(center);
+    // into the camera's frame: distance ahead and to the right
+    for (size_t i = 0; i < n; i++) {
+      float rx = set.xs[i] - x, ry = set.ys[i] - y;
+      ahead[i] = rx * fx + ry * fy;
+      side[i] = rx * -fy + ry * fx;
+    }
+    // culled in the same frame before anything costlier: the view is the
+    // wedge of half angle fov / 2 around the center, and a sprite reaches
+    // size / 2 out of it at most
+    float cos_half = std::cos(fov / 2), sin_half = std::sin(fov / 2);
+    float tan_half = sin_half / cos_half;
+    candidates.clear();
+    for (size_t i = 0; i < n; i++) {
+      float reach = set.sizes[i] / 2;
+      if (ahead[i] >= near_dis && ahead[i] <= max_dis &&
+          std::abs(side[i]) * cos_half - ahead[i] * sin_half <= reach)
+        candidates.push_back(uint32_t(i));
+    }
+    // both projections put the view's center at column w / 2
+    bool planar = projection == Projection::Planar;
+    float columns_per_unit = planar ? w / (2 * tan_half) : w / fov;
+    visible.clear();
+    for (uint32_t i : candidates) {
+      ProjectedSprite s;
+      if (planar) {
+        s.depth = ahead[i];
+        s.center = (side[i] / (ahead[i] * tan_half) + 1) * w / 2;
+      } else {
+        // along the ray, like the walls' distances, and by angle
+        s.depth = std::sqrt(ahead[i] * ahead[i] + side[i] * side[i]);
+        s.center = std::atan2(side[i], ahead[i]) * columns_per_unit + w / 2.0f;
+      }
+      if (s.depth > max_dis)
+        continue;
+      s.half_w = set.sizes[i] * columns_per_unit / (2 * s.depth);
+      if (s.x1() <= 0 || s.x0() >= long(w))
+        continue;
+      // the floor is where a wall's bottom would be at this distance
+      s.bottom = long(float(h) / 2 * (1 + 1 / s.depth));
+      s.top = s.bottom - long(set.sizes[i] * float(h) / s.depth);
+      s.color = set.colors[i];
+      visible.push_back(s);
+    }
+    std::sort(visible.begin(), visible.end(),
+              [](const ProjectedSprite &a, const ProjectedSprite &b) {
+                return a.depth > b.depth;
+              });
+  }
+  const std::vector<ProjectedSprite> &sprites() const { return visible; }
+
+private:
+  std::vector<float> ahead; // per sprite of the set, reused between frames
+  std::vector<float> side;
+  std::vector<uint32_t> candidates; // indices of those in the view
+  std::vector<ProjectedSprite> visible;
+};
@@ -0,0 +1,65 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// wall textures, all size x size texels, in one block of memory. every
+// texture is stored column by column: texel (u,v) of texture k is at
+// (k * size + u) * size + v, so the strip a wall slice samples is one run of
+// sequential memory (size = 64 is 256 bytes, a few cache lines)
+class TextureAtlas {
+public:
+  TextureAtlas() {}
+  TextureAtlas(size_t count, size_t size)
+      : n(count), edge(size), texels(count * size * size) {}
+
+  size_t count() const { return n; }
+  size_t size() const { return edge; }
+  uint32_t &at(size_t k, size_t u, size_t v) {
+    return texels[(k * edge + u) * edge + v];
+  }
+  // column u of texture k, size texels from top to bottom
+  const uint32_t *column(size_t k, size_t u) const {
+    return texels.data() + (k * edge + u) * edge;
+  }
+
+  // a brick wall in the color of each of the first count palette entries:
+  // bricks half as tall as wide, every other row shifted by half a brick,
+  // each brick a little lighter or darker, with darker mortar in between
+  static TextureAtlas bricks(const uint32_t *palette, size_t count,
+                             size_t size = 64) {
+    TextureAtlas atlas(count, size);
+    size_t brick_w = std::max<size_t>(size / 2, 1);
+    size_t brick_h = std::max<size_t>(size / 4, 1);
+    size_t mortar = std::max<size_t>(size / 32, 1);
+    for (size_t k = 0; k < count; k++)
+      for (size_t u = 0; u < size; u++)
+        for (size_t v = 0; v < size; v++) {
+          size_t row = v / brick_h;
+          size_t shifted = u + (row % 2) * brick_w / 2;
+          size_t col = shifted / brick_w;
+          bool is_mortar =
+              v % brick_h < mortar || shifted % brick_w < mortar;
+          // 192..255 of 256 per brick, half of that for mortar
+          uint32_t hash = uint32_t(row * 73856093u ^ col * 19349663u ^
+                                   k * 83492791u);
+          int scale = is_mortar ? 128 : 192 + int(hash >> 7) % 64;
+          atlas.at(k, u, v) = shade(palette[k], scale);
+        }
+    return atlas;
+  }
+
+private:
+  size_t n = 0;
+  size_t edge = 0;
+  std::vector<uint32_t> texels;
+
+  // the color with r, g and b times scale / 256, alpha kept
+  static uint32_t shade(uint32_t color, int scale) {
+    uint32_t out = color & 0xFF000000;
+    for (int shift = 0; shift < 24; shift += 8)
+      out |= ((color >> shift & 255) * uint32_t(scale) >> 8) << shift;
+    return out;
+  }
+};
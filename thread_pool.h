@@ -0,0 +1,219 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// a persistent pool of workers, each with its own queue of tiles.
+// parallel_for hands every worker a contiguous run of tiles; a worker takes
+// tiles from the front of its own queue and, once that is empty, steals from
+// the back of the others, so cheap and expensive tiles even out.
+// the calling thread works too while it waits, which also makes nested
+// parallel_for calls (windows -> columns) safe. once the queues have grown
+// to the largest job, a parallel_for allocates nothing
+class ThreadPool {
+public:
+  typedef std::function<void(size_t, size_t)> RangeFn; // [begin, end)
+
+  // a callable taking [begin, end), by reference: the caller's lambda stays
+  // on its stack instead of being copied into a std::function
+  class RangeRef {
+  public:
+    template <typename Fn>
+    RangeRef(const Fn &fn)
+        : object(&fn), call([](const void *object, size_t b, size_t e) {
+            (*static_cast<const Fn *>(object))(b, e);
+          }) {}
+    void operator()(size_t b, size_t e) const { call(object, b, e); }
+
+  private:
+    const void *object;
+    void (*call)(const void *, size_t, size_t);
+  };
+
+  explicit ThreadPool(size_t num_threads = default_threads()) {
+    size_t num_workers = num_threads > 1 ? num_threads - 1 : 0;
+    for (size_t i = 0; i < num_workers + 1; i++) // +1: the callers' queue
+      queues.emplace_back(new Queue());
+    for (size_t i = 0; i < num_workers; i++)
+      workers.emplace_back([this, i] { work(i); });
+  }
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_m);
+      stop = true;
+    }
+    cv.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+  }
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  size_t size() const { return workers.size() + 1; }
+
+  // calls fn on tiles of at most grain items covering [begin,end) and
+  // returns once all of them are done
+  void parallel_for(size_t begin, size_t end, size_t grain, RangeRef fn) {
+    if (begin >= end)
+      return;
+    grain = std::max<size_t>(grain, 1);
+    size_t num_tiles = (end - begin + grain - 1) / grain;
+    if (num_tiles == 1 || workers.empty()) {
+      for (size_t b = begin; b < end; b += grain)
+        fn(b, std::min(end, b + grain));
+      return;
+    }
+    Job job(fn, num_tiles);
+    {
+      std::lock_guard<std::mutex> lock(sleep_m);
+      queued += num_tiles; // counted first so it never drops below zero
+    }
+    size_t num_queues = queues.size();
+    for (size_t q = 0; q < num_queues; q++) {
+      size_t first = q * num_tiles / num_queues;
+      size_t last = (q + 1) * num_tiles / num_queues;
+      if (first == last)
+        continue;
+      std::lock_guard<std::mutex> lock(queues[q]->m);
+      for (size_t t = first; t < last; t++) {
+        size_t b = begin + t * grain;
+        queues[q]->tasks.push_back(Task{&job, b, std::min(end, b + grain)});
+      }
+    }
+    cv.notify_all();
+
+    while (job.pending.load() > 0) { // help out instead of blocking
+      if (run_one(self_index()))
+        continue;
+      std::unique_lock<std::mutex> lock(sleep_m);
+      cv.wait(lock, [&] { return job.pending.load() == 0 || queued > 0; });
+    }
+  }
+
+  // the pool shared by the renderer, sized by TRC_THREADS or the core count
+  static ThreadPool &shared() {
+    static ThreadPool pool;
+    return pool;
+  }
+  static size_t default_threads() {
+    if (const char *env = std::getenv("TRC_THREADS")) {
+      long n = std::atol(env);
+      if (n > 0)
+        return size_t(n);
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+private:
+  struct Job {
+    RangeRef fn;
+    std::atomic<size_t> pending;
+    Job(RangeRef fn, size_t n) : fn(fn), pending(n) {}
+  };
+  struct Task {
+    Job *job;
+    size_t begin;
+    size_t end;
+  };
+  // a deque of tasks in one ring that only grows; std::deque frees and
+  // allocates blocks as tasks pass through
+  class TaskRing {
+  public:
+    bool empty() const { return count == 0; }
+    void push_back(const Task &task) {
+      if (count == ring.size()) {
+        std::vector<Task> bigger(std::max<size_t>(64, 2 * ring.size()));
+        for (size_t i = 0; i < count; i++)
+          bigger[i] = ring[(head + i) % ring.size()];
+        ring.swap(bigger);
+        head = 0;
+      }
+      ring[(head + count++) % ring.size()] = task;
+    }
+    Task pop_front() {
+      Task task = ring[head];
+      head = (head + 1) % ring.size();
+      count--;
+      return task;
+    }
+    Task pop_back() { return ring[(head + --count) % ring.size()]; }
+
+  private:
+    std::vector<Task> ring;
+    size_t head = 0;
+    size_t count = 0;
+  };
+  struct Queue {
+    std::mutex m;
+    TaskRing tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+  std::mutex sleep_m;
+  std::condition_variable cv;
+  size_t queued = 0; // tasks in all queues, guarded by sleep_m
+  bool stop = false;
+
+  // which queue is "own": the worker's, or the shared one for outside callers
+  size_t self_index() const {
+    return worker_pool() == this ? worker_index() : queues.size() - 1;
+  }
+  static const ThreadPool *&worker_pool() {
+    static thread_local const ThreadPool *pool = nullptr;
+    return pool;
+  }
+  static size_t &worker_index() {
+    static thread_local size_t index = 0;
+    return index;
+  }
+
+  bool pop(size_t q, bool steal, Task &task) {
+    std::lock_guard<std::mutex> lock(queues[q]->m);
+    TaskRing &tasks = queues[q]->tasks;
+    if (tasks.empty())
+      return false;
+    task = steal ? tasks.pop_back() : tasks.pop_front();
+    return true;
+  }
+
+  bool run_one(size_t self) {
+    Task task;
+    bool found = pop(self, false, task);
+    for (size_t k = 1; !found && k < queues.size(); k++)
+      found = pop((self + k) % queues.size(), true, task);
+    if (!found)
+      return false;
+    {
+      std::lock_guard<std::mutex> lock(sleep_m);
+      queued--;
+    }
+    task.job->fn(task.begin, task.end);
+    if (task.job->pending.fetch_sub(1) == 1) {
+      // the job lives on its caller's stack, don't touch it after this
+      { std::lock_guard<std::mutex> lock(sleep_m); }
+      cv.notify_all();
+    }
+    return true;
+  }
+
+  void work(size_t index) {
+    worker_pool() = this;
+    worker_index() = index;
+    for (;;) {
+      if (run_one(index))
+        continue;
+      std::unique_lock<std::mutex> lock(sleep_m);
+      cv.wait(lock, [this] { return stop || queued > 0; });
+      if (stop && queued == 0)
+        return;
+    }
+  }
+};
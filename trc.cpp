@@ -1,258 +1,128 @@
-#pragma once
-#include <cassert>
-#include <cmath>
-#include <cstdint>
-#include <fstream>
-#include <iostream>
-#include <random>
-#include <string>
-#include <vector>
+#include <memory>
 
-const double PI = 3.14159265358979323846;
+#include "frame_stream.h"
+#include "map_file.h"
+#include "trc.h"
 
-class Screen;
-class Window;
-class ColorUtil;
-class Player;
-class LocalMiniMap;
-class FPV;
-
-class ColorUtil {
-public:
-  static std::vector<uint32_t> colors;
-  static uint32_t pack_colors(const uint8_t r, const uint8_t g, const uint8_t b,
-                              const uint8_t a = 255) {
-    return (a << 24) + (b << 16) + (g << 8) + r; // 0xAABBGGRR
-  }
-  static void unpack_colors(const uint32_t color, uint8_t &r, uint8_t &g,
-                            uint8_t &b, uint8_t &a) {
-    r = (color >> 0) & 255;
-    g = (color >> 8) & 255;
-    b = (color >> 16) & 255;
-    a = (color >> 24) & 255;
-  }
-};
-
-std::vector<uint32_t> ColorUtil::colors;
-
-class Screen {
-
-public:
-  size_t w; // width
-  size_t h; // height
-  std::vector<Window *> windows;
-  std::vector<uint32_t> buffer;
-
-  Screen(size_t w = 1024, size_t h = 512)
-      : w(w), h(h), buffer(w * h), windows() {};
-
-  void to_ppm(std::string filename = "./screen.ppm") {
-    std::ofstream ofs(filename,
-                      std::ios::binary); // binary mode is necessary for PPM
-    ofs << "P6\n" << w << " " << h << "\n" << 255 << "\n";
-    for (size_t i = 0; i < w * h; i++) {
-      uint8_t r, g, b, a;
-      ColorUtil::unpack_colors(buffer[i], r, g, b, a);
-      ofs << r << g << b;
+// (x,y) if it is an empty cell of the map, otherwise the middle of the first
+// empty cell, row by row. maps loaded from a file may have walls anywhere
+static void free_spot(const PacketGrid &grid, float &x, float &y) {
+  size_t i = size_t(x), j = size_t(y);
+  if (x >= 0 && y >= 0 && i < grid.w && j < grid.h &&
+      grid.cells[i + j * grid.w] == '0')
+    return;
+  for (size_t k = 0; k < grid.w * grid.h; k++)
+    if (grid.cells[k] == '0') {
+      x = k % grid.w + 0.5f;
+      y = k / grid.w + 0.5f;
+      return;
     }
-    ofs.close();
-  }
-};
+}
 
-class Window {
-public:
-  Screen *screen;
-  size_t o_x; // origin
-  size_t o_y;
-  size_t w;
-  size_t h;
-  Window(const Window & window)
-      : screen(window.screen), o_x(window.o_x), o_y(window.o_y), w(window.w), h(window.h) {
-    screen->windows.push_back(this);
-  };
-  Window(Screen *screen, size_t o_x = 0, size_t o_y = 0, size_t w = 512,
-         size_t h = 512)
-      : screen(screen), o_x(o_x), o_y(o_y), w(w), h(h) {
-    screen->windows.push_back(this);
-  };
-  uint32_t &access_virtual_buffer(size_t x, size_t y, bool &err) {
-    size_t global_index = (x + o_x) + (y + o_y) * screen->w;
-    if (global_index >= screen->w * screen->h) {
-      err = true;
-      return screen->buffer[0]; // or segmenation fault
-    }
-    return screen->buffer[global_index];
-  }
-  void
-  draw_rectangle_global(const size_t x, const size_t y, const size_t rec_w,
-                        const size_t rec_h,
-                        const uint32_t color) { // treat (o_x,o_y) as the origin
-    for (size_t i = 0; i < rec_w; i++)
-      for (size_t j = 0; j < rec_h; j++) {
-        bool err = false;
-        size_t cx = x + i;
-        size_t cy = y + j;
-        // assert(cx < w && cy < h);
-        if (cx >= w || cy >= h)
-          continue;
-        screen->buffer[cx + cy * w] = color;
-      }
-  }
-  void draw_rectangle_in_window(
-      const size_t x, const size_t y, const size_t rec_w, const size_t rec_h,
-      const uint32_t color) { // treat (o_x,o_y) as the origin
-    for (size_t i = 0; i < rec_w; i++)
-      for (size_t j = 0; j < rec_h; j++) {
-        bool err = false;
-        size_t cx = x + i;
-        size_t cy = y + j;
-        // assert(cx < w && cy < h);
-        if (cx >= w || cy >= h)
-          continue;
-        uint32_t &virtual_buffer = access_virtual_buffer(cx, cy, err);
-        if (err)
-          continue;
-        virtual_buffer = color;
-      }
-  }
-  void reset_origin(const size_t x,
-                    const size_t y) { // treat (x,y) as the new origin
-    this->o_x = x;                    // won't cause chaos?
-    this->o_y = y;
-  }
-
-  virtual void render(){}; // render here basically means updating the buffer
-};
-
-class Player {
-public:
-  Screen *screen;
-  LocalMiniMap *minimap = nullptr;
-  FPV *fpv = nullptr;
-  float x = 3.456; // unit: grid
-  float y = 2.345;
-  float a = 1.3; // start angle, the angle between the direction and the x-axis
-  float fov = PI / 3; // field of view
-  size_t num_laser = 512;
-  uint32_t color = 0xFFFFFFFF;
-  Player(Screen *screen, float x = 3.456, float y = 2.345, float a = 1.3,
-         float fov = PI / 3, uint32_t color = 0xFFFFFFFF)
-      : screen(screen), x(x), y(y), a(a), fov(fov), color(color) {};
-  // void draw_radar(float fov = PI / 3); // draw radar, the lines of sight
-  // void draw_FPV(float dis, size_t index); // draw first person view
-  //  dis: the distance to the wall
-  //  index: the index of the current laser
-  //  num_laser: the number of lasers
-  //  default: num_laser = window->minimap_w, a laser per pixel
-};
-
-class LocalMiniMap : public Window {
-public:
-  Player *player;
-  const char *matrix;
-  size_t grid_w = 16;
-  size_t grid_h = 16;
-  size_t cell_w;
-  size_t cell_h;
-  LocalMiniMap(const Window &window, const char *matrix, size_t grid_w = 16,
-               size_t grid_h = 16, Player *player = nullptr)
-      : Window(window), matrix(matrix), grid_w(grid_w), grid_h(grid_h),
-        player(player) {
-    cell_w = w / grid_w; // not window's width but the view's width
-    cell_h = h / grid_h;
-    init_ground();
-    init_wall();
+// trc                      -> ./screen.ppm
+// trc --image qoi|png      -> ./screen.qoi, ./screen.png: lossless, smaller
+// trc --stream raw|y4m [--frames N] [--fps F] [--out path|-] [--huge-pages]
+//                          -> a flythrough, as one video stream, rendered,
+//                             encoded and written on three threads;
+//                             --huge-pages: framebuffers on 2 MiB pages
+// --layout row|column|tiled: the screen's memory layout
+// --map file: a binary map (see map_file.h) instead of the built-in one
+// --save-map file: writes the map in use, with its palette, as a map file
+// --view-distance D: how far rays go, unit: grid (default 20)
+// --engine dda|pyramid|sdf: cell by cell, skipping empty blocks, or skipping
+//                           empty squares from a distance field (the same
+//                           image; the last two pay off on large open maps).
+//                           with --map the field is cached in file.sdf
+// --walls textured|flat: brick textures in the palette's colors (default),
+//                        or one flat color per wall
+// --items N: N billboards on random free cells, besides the two players
+// --projection angular|planar: the same angle between columns, or columns
+//                              evenly spaced on a camera plane (no fisheye)
+// --backing: the minimaps and FPVs render into surfaces of their own,
+//            composited into the screen (the same image)
+// --trace file.csv|file.json: per-frame stage times and counters per window
+//                             and player (needs a build with TRC_PROFILE)
+int main(int argc, char **argv)
+{
+  bool stream = false;
+  StreamFormat format = StreamFormat::Raw;
+  size_t num_frames = 300;
+  int fps = 30;
+  std::string out = "-";
+  bool huge_pages = false;
+  Layout layout = Layout::RowMajor;
+  std::string trace_path;
+  std::string map_path, save_map_path;
+  float view_dis = 20;
+  std::string engine = "dda";
+  Projection projection = Projection::Angular;
+  bool textured = true;
+  size_t num_items = 0;
+  bool backing = false;
+  std::string image = "ppm";
+  auto usage = [&] {
+    std::cerr << "usage: " << argv[0]
+              << " [--stream raw|y4m] [--frames N] [--fps F] [--out path|-]"
+              << " [--huge-pages]"
+              << " [--layout row|column|tiled] [--trace file.csv|file.json]"
+              << " [--map file] [--save-map file] [--view-distance D]"
+              << " [--engine dda|pyramid|sdf] [--walls textured|flat]"
+              << " [--items N] [--projection angular|planar] [--backing]"
+              << " [--image ppm|qoi|png]"
+              << std::endl;
+    return 1;
   };
-
-  void init_ground() {
-    for (size_t i = 0; i < w; i++)
-      for (size_t j = 0; j < h; j++) {
-        draw_rectangle_in_window(
-            i, j, 1, 1,
-            ColorUtil::pack_colors(255 * i / float(w), 0, 255 * j / float(h)));
-      }
-  }
-  void init_wall() {
-    for (size_t j = 0; j < grid_h; j++)
-      for (size_t i = 0; i < grid_w; i++) {
-        if (matrix[i + j * grid_w] == '0')
-          continue;
-        draw_rectangle_in_window(i * cell_w, j * cell_h, cell_w, cell_h,
-                                 ColorUtil::colors[matrix[i + j * grid_w] - '0']);
-      }
-  }
-
-  void draw_player() {
-    size_t px = player->x * cell_w;
-    size_t py = player->y * cell_h;
-    draw_rectangle_in_window(px, py, 5, 5,
-                             ColorUtil::pack_colors(255, 255, 255));
-  }
-
-  float shoot_laser(float angle, const uint32_t color, uint32_t& brick_color,  bool draw = true) {
-    float l = 0;
-    for (; l < 20; l += 0.01) { //l+=0.05 will cause sawtooth
-      float cx = player->x + l * cos(angle); // logic coordinates
-      float cy = player->y + l * sin(angle);
-      size_t pix_x = int(cx * cell_w); // pixel coordinates
-      size_t pix_y = int(cy * cell_h);
-      if (draw)
-        draw_rectangle_in_window(pix_x, pix_y, 1, 1, color);
-      if (matrix[int(cx) + int(cy) * grid_w] != '0') {
-        //draw_rectangle_in_window(pix_x, pix_y, 1, 1, ColorUtil::pack_colors(0, 255, 0));
-        brick_color = ColorUtil::colors[matrix[int(cx) + int(cy) * grid_w] - '0'];
-        break;
+  try { // std::stoul and the like throw on values that aren't numbers
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      bool has_value = i + 1 < argc;
+      if (arg == "--stream" && has_value) {
+        stream = true;
+        format = std::string(argv[++i]) == "y4m" ? StreamFormat::Y4M
+                                                  : StreamFormat::Raw;
+      } else if (arg == "--frames" && has_value) {
+        num_frames = std::stoul(argv[++i]);
+      } else if (arg == "--fps" && has_value) {
+        fps = std::stoi(argv[++i]);
+      } else if (arg == "--out" && has_value) {
+        out = argv[++i];
+      } else if (arg == "--huge-pages") {
+        huge_pages = true;
+      } else if (arg == "--layout" && has_value) {
+        std::string kind = argv[++i];
+        layout = kind == "column" ? Layout::ColumnMajor
+                 : kind == "tiled" ? Layout::Tiled
+                                   : Layout::RowMajor;
+      } else if (arg == "--trace" && has_value) {
+        trace_path = argv[++i];
+      } else if (arg == "--view-distance" && has_value) {
+        view_dis = std::stof(argv[++i]);
+      } else if (arg == "--engine" && has_value) {
+        engine = argv[++i];
+      } else if (arg == "--walls" && has_value) {
+        textured = std::string(argv[++i]) != "flat";
+      } else if (arg == "--items" && has_value) {
+        num_items = std::stoul(argv[++i]);
+      } else if (arg == "--projection" && has_value) {
+        projection = std::string(argv[++i]) == "planar"
+                         ? Projection::Planar
+                         : Projection::Angular;
+      } else if (arg == "--image" && has_value) {
+        image = argv[++i];
+      } else if (arg == "--backing") {
+        backing = true;
+      } else if (arg == "--map" && has_value) {
+        map_path = argv[++i];
+      } else if (arg == "--save-map" && has_value) {
+        save_map_path = argv[++i];
+      } else {
+        return usage();
       }
     }
-    return l;
-  }
-
-  void draw_radar() {
-    float player_ca = player->a;
-    uint32_t brick_color;
-    for (size_t i = 0; i < (player->num_laser); i++) {
-      shoot_laser(player_ca, ColorUtil::pack_colors(255, 255, 255),brick_color, true);
-      player_ca += player->fov / player->num_laser;
-    }
+  } catch (const std::exception &) {
+    return usage();
   }
 
-  void render() override {
-    draw_player();
-    draw_radar();
-  }
-};
-
-class FPV : public Window {
-public:
-  Player *player;
-  FPV(Window &window, Player *player)
-      : Window(window), player(player) {
-  };
-  void draw_FPV(size_t i,float dis,uint32_t color = ColorUtil::pack_colors(255, 255, 255)) {
-
-      /*draw_rectangle_in_window(i, float(h) / 2.0 * (1.0 - 1.0 / dis), 1, float(h) / dis,
-                               ColorUtil::pack_colors(255, 255, 255));*/
-      draw_rectangle_in_window(i, float(h) / 2.0 * (1.0 - 1.0 / dis), 1, float(h) / dis,
-                               color);
-      //printf h/dis
-      //printf("h/dis: %zu\n", static_cast<size_t>(h / dis));
-    
-  }
-  void render() override {
-    float player_ca = player->a;
-    for (size_t i = 0; i < w; i++) {
-      uint32_t brick_color;
-      float dis = player->minimap->shoot_laser(player_ca, ColorUtil::pack_colors(255, 255, 255),brick_color, false);
-      //printf("dis: %f\n", dis);
-      draw_FPV(i,dis,brick_color);
-      player_ca += player->fov / w;
-    }
-  }
-};
-
-int main()
-{
-  
   std::random_device rd;
   std::mt19937 gen(rd());
   std::uniform_int_distribution<> dis(0, 255);
@@ -260,48 +130,149 @@ int main()
   for(int i = 0; i < 256; i++) {
     ColorUtil::colors.push_back(ColorUtil::pack_colors(dis(gen), dis(gen), dis(gen)));
   }
-  const char matrix[] = "1111111111111111"
-                        "1000000000000001"
-                        "1000000000000001"
-                        "1000555511000001"
-                        "1000100000000001"
-                        "1000100077711111"
-                        "1000100000000001"
-                        "1000100000000001"
-                        "1000122222200001"
-                        "1000003000900001"
-                        "1000003000866111"
-                        "1000000000800001"
-                        "1000144111800001"
-                        "1000100000000001"
-                        "1000000000000001"
-                        "1111111111111111";
+  PacketGrid grid(builtin_map(), 16, 16); // both minimaps share it
 
+  MapFile map_file;
+  if (!map_path.empty()) {
+    if (!map_file.open(map_path)) {
+      std::cerr << map_path << ": " << map_file.error() << std::endl;
+      return 1;
+    }
+    grid = map_file.packet_grid();
+    std::copy(map_file.palette(), map_file.palette() + map_file.palette_size(),
+              ColorUtil::colors.begin());
+  }
+  if (!save_map_path.empty() &&
+      !save_map(save_map_path, grid.cells, grid.w, grid.h,
+                ColorUtil::colors.data(),
+                std::min<size_t>(ColorUtil::colors.size(),
+                                 MapFile::max_materials))) {
+    std::cerr << save_map_path << ": can't save the map" << std::endl;
+    return 1;
+  }
+  float x1 = 2.456, y1 = 10.345, x2 = 12.456, y2 = 8.345;
+  free_spot(grid, x1, y1);
+  free_spot(grid, x2, y2);
+  std::unique_ptr<OccupancyPyramid> pyramid;
+  std::unique_ptr<DistanceField> field;
+  if (engine == "pyramid")
+    pyramid.reset(new OccupancyPyramid(grid.cells, grid.w, grid.h));
+  else if (engine == "sdf" && !map_path.empty())
+    field.reset(new DistanceField(DistanceField::cached(
+        map_path + ".sdf", grid.cells, grid.w, grid.h)));
+  else if (engine == "sdf")
+    field.reset(new DistanceField(grid.cells, grid.w, grid.h));
+
+  Screen screen(1024, 1024, layout);
 
-  Screen screen(1024, 1024);
+  // the built-in map's size is known here, so its minimaps (and the FPVs'
+  // casts through them) get code specialized for it
+  auto make_minimap = [&](const Window &window, Player *owner) {
+    return map_path.empty()
+               ? new StaticMiniMap<16, 16, 512, 512>(window, grid, owner)
+               : new LocalMiniMap(window, grid, owner);
+  };
 
   Window window1(&screen, 0, 0, 512, 512);
   Window window2(&screen, 512, 0, 512, 512);
-  Player player(&screen, 2.456, 10.345, -0.6, PI / 3, 0xFFFFFFFF);
-  LocalMiniMap minimap(window1, matrix, 16, 16, &player);
-  FPV fpv(window2, &player);
-  player.minimap = &minimap;
+  Player player(&screen, x1, y1, -0.6, PI / 3, 0xFFFFFFFF);
+  std::unique_ptr<LocalMiniMap> minimap(make_minimap(window1, &player));
+  FPV fpv(window2, &player, projection);
+  player.minimap = minimap.get();
   player.fpv = &fpv;
-
-  minimap.render();
-  fpv.render(); 
+  player.view_dis = view_dis;
+  minimap->pyramid = pyramid.get();
+  minimap->field = field.get();
+  // one texture per material a map can have
+  TextureAtlas textures = TextureAtlas::bricks(
+      ColorUtil::colors.data(),
+      std::min<size_t>(ColorUtil::colors.size(), MapFile::max_materials));
+  if (textured)
+    fpv.textures = &textures;
 
 //add a player with different parameters
   Window window3(&screen, 0, 512, 512, 512);
   Window window4(&screen, 512, 512, 512, 512);
-  Player player2(&screen, 12.456, 8.345, 3, PI / 3, 0xFFFFFFFF);
-  LocalMiniMap minimap2(window3, matrix, 16, 16, &player2);
-  FPV fpv2(window4, &player2);
-  player2.minimap = &minimap2;
+  Player player2(&screen, x2, y2, 3, PI / 3, 0xFFFFFFFF);
+  std::unique_ptr<LocalMiniMap> minimap2(make_minimap(window3, &player2));
+  FPV fpv2(window4, &player2, projection);
+  player2.minimap = minimap2.get();
   player2.fpv = &fpv2;
-  minimap2.render();
-  fpv2.render();
+  player2.view_dis = view_dis;
+  minimap2->pyramid = pyramid.get();
+  minimap2->field = field.get();
+  if (textured)
+    fpv2.textures = &textures;
+
+  // each player sees the other one (its own sprite is too close to draw)
+  SpriteSet sprites;
+  sprites.add(player.x, player.y, 0.5f, ColorUtil::pack_colors(255, 255, 255));
+  sprites.add(player2.x, player2.y, 0.5f, ColorUtil::pack_colors(255, 64, 64));
+  std::uniform_int_distribution<size_t> cell(0, grid.w * grid.h - 1);
+  for (size_t i = 0; i < num_items && grid.w * grid.h > 0; i++) {
+    size_t k = cell(gen);
+    if (grid.cells[k] == '0')
+      sprites.add(k % grid.w + 0.5f, k / grid.w + 0.5f, 0.25f,
+                  ColorUtil::pack_colors(255, 215, 0));
+  }
+  fpv.sprites = &sprites;
+  fpv2.sprites = &sprites;
+
+  // only the windows that draw: window1..4 are the layouts they were copied
+  // from and never render
+  if (backing)
+    for (Window *window : std::initializer_list<Window *>{
+             minimap.get(), &fpv, minimap2.get(), &fpv2})
+      window->set_backing(true);
 
-    screen.to_ppm("./screen.ppm");
-  return 0;
+  std::unique_ptr<FrameTrace> trace;
+  if (!trace_path.empty()) {
+#ifndef TRC_PROFILE
+    std::cerr << "built without TRC_PROFILE, the trace will be all zeros"
+              << std::endl;
+#endif
+    trace.reset(new FrameTrace(trace_path));
+  }
+  Player *players[] = {&player, &player2};
+  auto record = [&](size_t frame, const FrameStats &screen_stats) {
+    if (!trace)
+      return;
+    for (long p = 0; p < 2; p++) {
+      trace->record(frame, players[p]->minimap->name(), p,
+                    players[p]->minimap->stats);
+      trace->record(frame, players[p]->fpv->name(), p, players[p]->fpv->stats);
+      trace->record(frame, "Player", p, players[p]->frame_stats());
+    }
+    trace->record(frame, "Screen", -1, screen_stats);
+  };
+
+  if (!stream) {
+    screen.render(); // both players, all windows at once
+    if (image == "qoi")
+      screen.to_qoi("./screen.qoi");
+    else if (image == "png")
+      screen.to_png("./screen.png");
+    else
+      screen.to_ppm("./screen.ppm");
+    record(0, screen.stats);
+    return 0;
+  }
+
+  FrameStream frames(out, screen.layout, format, fps, 2, huge_pages);
+  std::vector<Rect> dirty; // traded with the screen frame after frame
+  for (size_t frame = 0; frame < num_frames; frame++) {
+    screen.render(); // only the windows of players that moved
+    // encoded and written while the next frames render
+    screen.take_dirty(dirty);
+    frames.submit(screen.pixels, dirty);
+    // encoding runs behind, this is the latest frame that finished
+    FrameStats screen_stats = screen.stats;
+    screen_stats += frames.stats();
+    record(frame, screen_stats);
+    player.walk(0.05, 0.01);
+    player2.walk(0.05, -0.01);
+    sprites.move(0, player.x, player.y);
+    sprites.move(1, player2.x, player2.y);
+  }
+  return frames.finish() ? 0 : 1;
 }
\ No newline at end of file
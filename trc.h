@@ -0,0 +1,1036 @@
+#pragma once
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "blend.h"
+#include "distance_field.h"
+#include "encoder.h"
+#include "frame_layout.h"
+#include "occupancy.h"
+#include "png.h"
+#include "profile.h"
+#include "qoi.h"
+#include "ray_packet.h"
+#include "raycast.h"
+#include "sprite.h"
+#include "texture.h"
+#include "thread_pool.h"
+
+const double PI = 3.14159265358979323846;
+
+class Screen;
+class Window;
+class ColorUtil;
+class Player;
+class LocalMiniMap;
+class FPV;
+
+class ColorUtil {
+public:
+  static std::vector<uint32_t> colors;
+  static uint32_t pack_colors(const uint8_t r, const uint8_t g, const uint8_t b,
+                              const uint8_t a = 255) {
+    return (a << 24) + (b << 16) + (g << 8) + r; // 0xAABBGGRR
+  }
+  static void unpack_colors(const uint32_t color, uint8_t &r, uint8_t &g,
+                            uint8_t &b, uint8_t &a) {
+    r = (color >> 0) & 255;
+    g = (color >> 8) & 255;
+    b = (color >> 16) & 255;
+    a = (color >> 24) & 255;
+  }
+};
+
+std::vector<uint32_t> ColorUtil::colors;
+
+class Screen {
+
+public:
+  size_t w; // width
+  size_t h; // height
+  std::vector<Window *> windows;
+  FrameLayout layout; // the order of the pixels in buffer
+  PixelBuffer buffer;
+  // where the windows draw: buffer, or the memory given to attach()
+  uint32_t *pixels;
+  FrameStats stats; // composite and encode of the last frame
+
+  Screen(size_t w = 1024, size_t h = 512, Layout kind = Layout::RowMajor)
+      : w(w), h(h), windows(), layout(w, h, kind), buffer(layout.size()),
+        pixels(buffer.data()), dirty(1, Rect(0, 0, w, h)) {};
+  // without a buffer of its own: draws into external, layout.size() pixels,
+  // or with nullptr into nothing until attach() gives it some
+  Screen(size_t w, size_t h, uint32_t *external,
+         Layout kind = Layout::RowMajor)
+      : w(w), h(h), windows(), layout(w, h, kind), pixels(external),
+        dirty(1, Rect(0, 0, w, h)) {}
+  Screen(const Screen &) = delete;
+  Screen &operator=(const Screen &) = delete;
+
+  // draw into layout.size() pixels elsewhere (e.g. shared memory handed to
+  // another process) instead of buffer, until detach(). both repaint
+  // everything on the next render()
+  void attach(uint32_t *external) {
+    pixels = external;
+    invalidate();
+  }
+  void detach() { attach(buffer.data()); } // nullptr without a buffer
+
+  // render the windows whose inputs changed since they were last rendered,
+  // concurrently, then composite the ones with a backing surface; their
+  // regions become dirty
+  void render();
+  // every window is rendered by the next render(), whatever its inputs, and
+  // all of the buffer counts as dirty (e.g. after writing to it directly)
+  void invalidate();
+  // the regions repainted since the last call (all of the screen at first),
+  // for whoever turns the buffer into output. one consumer per screen
+  std::vector<Rect> take_dirty() {
+    std::vector<Rect> taken;
+    taken.swap(dirty);
+    return taken;
+  }
+  // the same into a list kept by the caller, whose memory the screen gets
+  // in exchange: frame after frame, neither side allocates
+  void take_dirty(std::vector<Rect> &into) {
+    into.clear();
+    into.swap(dirty);
+  }
+
+  uint32_t &at(size_t x, size_t y) { return pixels[layout.index(x, y)]; }
+  // the pixels [x0,x1) of row y
+  void fill_row(size_t x0, size_t x1, size_t y, uint32_t color) {
+    if (layout.kind == Layout::RowMajor) {
+      std::fill_n(pixels + x0 + y * w, x1 - x0, color);
+    } else if (layout.kind == Layout::ColumnMajor) {
+      for (size_t x = x0; x < x1; x++)
+        pixels[y + x * h] = color;
+    } else {
+      for (size_t x = x0; x < x1;) { // contiguous inside each tile
+        size_t end = std::min(x1, (x / FrameLayout::tile + 1) * FrameLayout::tile);
+        std::fill_n(&pixels[layout.index(x, y)], end - x, color);
+        x = end;
+      }
+    }
+  }
+  // the pixels [y0,y1) of column x
+  void fill_column(size_t x, size_t y0, size_t y1, uint32_t color) {
+    if (layout.kind == Layout::ColumnMajor) {
+      std::fill_n(pixels + y0 + x * h, y1 - y0, color);
+    } else if (layout.kind == Layout::RowMajor) {
+      uint32_t *p = pixels + x + y0 * w;
+      for (size_t y = y0; y < y1; y++, p += w)
+        *p = color;
+    } else {
+      for (size_t y = y0; y < y1;) { // stride of a tile row inside each tile
+        size_t end = std::min(y1, (y / FrameLayout::tile + 1) * FrameLayout::tile);
+        uint32_t *p = &pixels[layout.index(x, y)];
+        for (; y < end; y++, p += FrameLayout::tile)
+          *p = color;
+      }
+    }
+  }
+
+  // fill_row and fill_column with color blended over what is there
+  void blend_row(size_t x0, size_t x1, size_t y, uint32_t color,
+                 BlendMode mode) {
+    if (layout.kind == Layout::RowMajor) {
+      blend_fill(pixels + x0 + y * w, color, x1 - x0, mode);
+    } else if (layout.kind == Layout::ColumnMajor) {
+      for (size_t x = x0; x < x1; x++)
+        blend_fill(pixels + y + x * h, color, 1, mode);
+    } else {
+      for (size_t x = x0; x < x1;) {
+        size_t end = std::min(x1, (x / FrameLayout::tile + 1) * FrameLayout::tile);
+        blend_fill(&pixels[layout.index(x, y)], color, end - x, mode);
+        x = end;
+      }
+    }
+  }
+  void blend_column(size_t x, size_t y0, size_t y1, uint32_t color,
+                    BlendMode mode) {
+    if (layout.kind == Layout::ColumnMajor) {
+      blend_fill(pixels + y0 + x * h, color, y1 - y0, mode);
+    } else {
+      for (size_t y = y0; y < y1; y++)
+        blend_fill(&pixels[layout.index(x, y)], color, 1, mode);
+    }
+  }
+
+  // the pixels [y0,y1) of column x from a texture strip: pixel y0 + i gets
+  // strip[(v + i * step) >> 32], positions in 32.32 fixed point
+  void texture_column(size_t x, size_t y0, size_t y1, const uint32_t *strip,
+                      uint64_t v, uint64_t step) {
+    const uint64_t one = uint64_t(1) << 32;
+    if (step == 0) {
+      // a wall so close that the whole window is inside one texel
+      fill_column(x, y0, y1, strip[v >> 32]);
+    } else if (step <= one / 4) {
+      // magnified, every texel covers 4 pixels or more: fill them as runs
+      for (size_t y = y0; y < y1;) {
+        uint64_t pos = v + (y - y0) * step;
+        uint64_t next = (pos & ~(one - 1)) + one; // the next texel's start
+        size_t end = std::min<uint64_t>(y1, y0 + (next - v + step - 1) / step);
+        fill_column(x, y, end, strip[pos >> 32]);
+        y = end;
+      }
+    } else if (layout.kind == Layout::ColumnMajor) {
+      uint32_t *p = pixels + y0 + x * h;
+      for (size_t i = 0; i < y1 - y0; i++, v += step)
+        p[i] = strip[v >> 32];
+    } else if (layout.kind == Layout::RowMajor) {
+      uint32_t *p = pixels + x + y0 * w;
+      for (size_t y = y0; y < y1; y++, p += w, v += step)
+        *p = strip[v >> 32];
+    } else {
+      for (size_t y = y0; y < y1;) {
+        size_t end = std::min(y1, (y / FrameLayout::tile + 1) * FrameLayout::tile);
+        uint32_t *p = &pixels[layout.index(x, y)];
+        for (; y < end; y++, p += FrameLayout::tile, v += step)
+          *p = strip[v >> 32];
+      }
+    }
+  }
+
+  // re-encodes the dirty regions only, the rest is kept from the last call
+  void to_ppm(std::string filename = "./screen.ppm") {
+    TRC_STAGE(stats, Stage::Encode);
+    ppm.update(pixels, layout, take_dirty());
+    ppm.write(filename);
+    TRC_PROFILE_ONLY(stats.bytes_encoded += ppm.bytes().size();)
+  }
+
+  // the whole frame, compressed (see qoi.h, png.h). the dirty regions are
+  // left to to_ppm() or whoever else takes them. false if the file couldn't
+  // be written
+  bool to_qoi(std::string filename = "./screen.qoi") {
+    return encode_to(filename, qoi);
+  }
+  bool to_png(std::string filename = "./screen.png") {
+    return encode_to(filename, png);
+  }
+
+private:
+  static const size_t max_dirty = 256;
+  std::vector<Rect> dirty;
+  PpmImage ppm;
+  // render()'s lists, kept for their memory
+  std::vector<Window *> changed;
+  std::vector<Rect> areas;
+  std::vector<const Window *> layers;
+  QoiEncoder qoi;
+  PngEncoder png;
+
+  template <typename Encoder>
+  bool encode_to(const std::string &filename, Encoder &encoder) {
+    TRC_STAGE(stats, Stage::Encode);
+    FileOutput file;
+    if (!file.open(filename))
+      return false;
+    bool ok = encoder.encode(pixels, layout, [&](const uint8_t *data, size_t n) {
+      TRC_PROFILE_ONLY(stats.bytes_encoded += n;)
+      return file.write(data, n);
+    });
+    return file.close() && ok;
+  }
+
+  void composite();
+};
+
+class Window {
+public:
+  Screen *screen;
+  size_t o_x; // origin
+  size_t o_y;
+  size_t w;
+  size_t h;
+  FrameStats stats; // of the last render(), filled in with TRC_PROFILE
+  bool stale = true; // rendered by the next Screen::render() regardless
+  uint64_t rendered_version = 0; // input_version() at the last render
+  // stacking order of windows with a backing surface, higher on top. those
+  // are composited over the windows drawing straight into the screen
+  int z = 0;
+  // how the backing surface goes over what lies below it, see blend.h.
+  // anything but Copy needs the windows below redrawn whenever it changes,
+  // Screen::render() does that for the ones without a backing
+  BlendMode blend = BlendMode::Copy;
+  Window(const Window & window)
+      : screen(window.screen), o_x(window.o_x), o_y(window.o_y), w(window.w), h(window.h),
+        z(window.z), blend(window.blend) {
+    screen->windows.push_back(this);
+  };
+  Window(Screen *screen, size_t o_x = 0, size_t o_y = 0, size_t w = 512,
+         size_t h = 512)
+      : screen(screen), o_x(o_x), o_y(o_y), w(w), h(h) {
+    screen->windows.push_back(this);
+  };
+  // pixel (x,y) of the window; err for one outside the window's part of the
+  // screen, which is also all a backing surface holds
+  uint32_t &access_virtual_buffer(size_t x, size_t y, bool &err) {
+    if (x >= visible_w() || y >= visible_h()) {
+      err = true;
+      return target()->pixels[0]; // or segmenation fault
+    }
+    return target()->at(x + target_x(), y + target_y());
+  }
+  // kept for older callers: the same as draw_rectangle_in_window, clipped to
+  // the window and drawn through target() in the screen's layout
+  void draw_rectangle_global(const size_t x, const size_t y,
+                             const size_t rec_w, const size_t rec_h,
+                             const uint32_t color) {
+    draw_rectangle_in_window(x, y, rec_w, rec_h, color);
+  }
+  // the part of the window that lies on the screen
+  size_t visible_w() const {
+    return o_x < screen->w ? std::min(w, screen->w - o_x) : 0;
+  }
+  size_t visible_h() const {
+    return o_y < screen->h ? std::min(h, screen->h - o_y) : 0;
+  }
+  // the first pixel of row y of the window, y < visible_h().
+  // only for row-major screens
+  uint32_t *row(size_t y) {
+    return target()->pixels + target_x() + (y + target_y()) * target()->w;
+  }
+
+  // render into a surface of the window's own (w x h, in the screen's
+  // layout, starting on a cache line) instead of the screen;
+  // Screen::render() copies the changed ones over by z. windows that overlap
+  // or share cache lines at their borders can then render at the same time
+  void set_backing(bool on) {
+    if (on)
+      backing.reset(new Screen(w, h, screen->layout.kind));
+    else
+      backing.reset();
+    stale = true;
+  }
+  bool has_backing() const { return bool(backing); }
+  const Screen *backing_surface() const { return backing.get(); }
+  // where the drawing helpers write: the screen at the window's origin, or
+  // the backing surface at (0,0)
+  Screen *target() const { return backing ? backing.get() : screen; }
+  size_t target_x() const { return backing ? 0 : o_x; }
+  size_t target_y() const { return backing ? 0 : o_y; }
+  // rect() on target()
+  Rect target_rect() const {
+    return Rect(target_x(), target_y(), target_x() + visible_w(),
+                target_y() + visible_h());
+  }
+  void draw_rectangle_in_window(
+      const size_t x, const size_t y, const size_t rec_w, const size_t rec_h,
+      const uint32_t color,
+      BlendMode mode = BlendMode::Copy) { // treat (o_x,o_y) as the origin
+    // clip once against the window and the screen, then fill whole rows
+    size_t vis_w = visible_w(), vis_h = visible_h();
+    if (x >= vis_w || y >= vis_h)
+      return;
+    size_t fill_w = std::min(rec_w, vis_w - x);
+    size_t fill_h = std::min(rec_h, vis_h - y);
+    TRC_PROFILE_ONLY(stats.pixels_written += fill_w * fill_h;)
+    Screen *surface = target();
+    size_t s_x = target_x(), s_y = target_y();
+    if (mode != BlendMode::Copy) {
+      if (surface->layout.kind == Layout::ColumnMajor)
+        for (size_t i = x; i < x + fill_w; i++)
+          surface->blend_column(i + s_x, y + s_y, y + s_y + fill_h, color, mode);
+      else
+        for (size_t j = y; j < y + fill_h; j++)
+          surface->blend_row(x + s_x, x + s_x + fill_w, j + s_y, color, mode);
+      return;
+    }
+    if (surface->layout.kind == Layout::ColumnMajor)
+      for (size_t i = x; i < x + fill_w; i++)
+        surface->fill_column(i + s_x, y + s_y, y + s_y + fill_h, color);
+    else
+      for (size_t j = y; j < y + fill_h; j++)
+        surface->fill_row(x + s_x, x + s_x + fill_w, j + s_y, color);
+  }
+  // the line from (x0,y0) to (x1,y1), both ends included, in window pixels:
+  // one pixel a step along the longer axis, the other axis at
+  // (2 i minor + major) / (2 major) after step i (bresenham). clipped once,
+  // to the steps that land on the visible part, so each pixel is written
+  // exactly once and a clipped line keeps the pixels it would have had
+  void draw_line(long x0, long y0, long x1, long y1, uint32_t color) {
+    int64_t max_x = int64_t(visible_w()) - 1, max_y = int64_t(visible_h()) - 1;
+    if (max_x < 0 || max_y < 0)
+      return;
+    int64_t dx = std::abs(int64_t(x1) - x0), dy = std::abs(int64_t(y1) - y0);
+    int sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+    bool steep = dy > dx;
+    int64_t major = steep ? dy : dx, minor = steep ? dx : dy;
+    int64_t den = std::max<int64_t>(2 * major, 1); // 1: a single point
+    // the steps [first,last] whose pixel is inside, from both axes
+    int64_t first = 0, last = major;
+    if (!clip_steps(steep ? y0 : x0, steep ? sy : sx, steep ? max_y : max_x,
+                    1, 0, 1, first, last) ||
+        !clip_steps(steep ? x0 : y0, steep ? sx : sy, steep ? max_x : max_y,
+                    2 * minor, major, den, first, last))
+      return;
+    TRC_PROFILE_ONLY(stats.pixels_written += last - first + 1;)
+
+    int64_t r = 2 * first * minor + major; // the minor axis' remainder
+    int64_t m = r / den;
+    r -= m * den;
+    size_t x = size_t(x0 + sx * (steep ? m : first)) + target_x();
+    size_t y = size_t(y0 + sy * (steep ? first : m)) + target_y();
+    Screen *surface = target();
+    // row- and column-major: a step is a fixed offset. tiled: by index
+    Layout kind = surface->layout.kind;
+    bool linear = kind != Layout::Tiled;
+    ptrdiff_t step_x = kind == Layout::ColumnMajor ? ptrdiff_t(surface->h) : 1;
+    ptrdiff_t step_y = kind == Layout::ColumnMajor ? 1 : ptrdiff_t(surface->w);
+    step_x *= linear ? sx : 0;
+    step_y *= linear ? sy : 0;
+    ptrdiff_t step_major = steep ? step_y : step_x;
+    ptrdiff_t step_minor = steep ? step_x : step_y;
+    size_t &x_major = steep ? y : x, &x_minor = steep ? x : y;
+    int s_major = steep ? sy : sx, s_minor = steep ? sx : sy;
+    uint32_t *p = &surface->at(x, y);
+    for (int64_t i = first; i <= last; i++) {
+      (linear ? *p : surface->at(x, y)) = color;
+      x_major += s_major;
+      p += step_major;
+      r += 2 * minor;
+      if (r >= den) {
+        r -= den;
+        x_minor += s_minor;
+        p += step_minor;
+      }
+    }
+  }
+  // column x from top to bottom in one pass: ceiling above wall_top, the
+  // wall in [wall_top, wall_bottom), floor below. every pixel is written, so
+  // nothing of the previous frame survives. the wall may reach past the window
+  void draw_column(size_t x, long wall_top, long wall_bottom,
+                   uint32_t ceiling, uint32_t wall, uint32_t floor) {
+    long vis_h = long(visible_h());
+    if (x >= visible_w() || vis_h == 0)
+      return;
+    long top = std::max(0L, std::min(wall_top, vis_h));
+    long bottom = std::max(top, std::min(wall_bottom, vis_h));
+    // sequential memory on column-major screens, a strided walk otherwise
+    Screen *surface = target();
+    size_t s_x = x + target_x(), s_y = target_y();
+    surface->fill_column(s_x, s_y, s_y + top, ceiling);
+    surface->fill_column(s_x, s_y + top, s_y + bottom, wall);
+    surface->fill_column(s_x, s_y + bottom, s_y + vis_h, floor);
+  }
+  // draw_column with a textured wall: the strip of n texels is stretched
+  // over [wall_top, wall_bottom), of which the part inside the window is drawn
+  void draw_textured_column(size_t x, long wall_top, long wall_bottom,
+                            uint32_t ceiling, const uint32_t *strip, size_t n,
+                            uint32_t floor) {
+    long vis_h = long(visible_h());
+    if (x >= visible_w() || vis_h == 0)
+      return;
+    long top = std::max(0L, std::min(wall_top, vis_h));
+    long bottom = std::max(top, std::min(wall_bottom, vis_h));
+    Screen *surface = target();
+    size_t s_x = x + target_x(), s_y = target_y();
+    surface->fill_column(s_x, s_y, s_y + top, ceiling);
+    if (bottom > top) {
+      uint64_t step = (uint64_t(n) << 32) / uint64_t(wall_bottom - wall_top);
+      surface->texture_column(s_x, s_y + top, s_y + bottom, strip,
+                              uint64_t(top - wall_top) * step, step);
+    }
+    surface->fill_column(s_x, s_y + bottom, s_y + vis_h, floor);
+  }
+  void reset_origin(const size_t x,
+                    const size_t y) { // treat (x,y) as the new origin
+    this->o_x = x;                    // won't cause chaos?
+    this->o_y = y;
+  }
+
+  // the part of the screen the window covers
+  Rect rect() const {
+    return Rect(o_x, o_y, std::min(o_x + w, screen->w),
+                std::min(o_y + h, screen->h));
+  }
+
+  virtual ~Window() {}
+  virtual void render(){}; // render here basically means updating the buffer
+  virtual const char *name() const { return "Window"; }
+  // changes whenever something render() draws from does, Screen::render()
+  // skips the window while it stays the same. things that don't count in
+  // (the map, the palette, colors) need Screen::invalidate()
+  virtual uint64_t input_version() const { return 0; }
+
+private:
+  std::unique_ptr<Screen> backing; // see set_backing()
+
+  // narrows [first,last] to the steps i of a line whose coordinate
+  // start + sign * ((num * i + add) / den) lies in [0,max]; false when none
+  // do. the division rounds down, num and add are >= 0 and den > 0
+  static bool clip_steps(int64_t start, int sign, int64_t max, int64_t num,
+                         int64_t add, int64_t den, int64_t &first,
+                         int64_t &last) {
+    // the offset along the line has to be in [lo,hi]
+    int64_t lo = sign > 0 ? -start : start - max;
+    int64_t hi = sign > 0 ? max - start : start;
+    if (num == 0) // it stays at add / den
+      return add / den >= lo && add / den <= hi && first <= last;
+    // (num i + add) / den >= lo <=> i >= ceil((den lo - add) / num)
+    // (num i + add) / den <= hi <=> i <= floor((den (hi+1) - add - 1) / num)
+    first = std::max(first, -floor_div(add - den * lo, num));
+    last = std::min(last, floor_div(den * (hi + 1) - add - 1, num));
+    return first <= last;
+  }
+  static int64_t floor_div(int64_t a, int64_t b) { // b > 0
+    return a / b - (a % b < 0);
+  }
+};
+
+// windows own disjoint regions of the buffer, or their own backing surface,
+// so they need no locking
+inline void Screen::render() {
+  TRC_PROFILE_ONLY(stats = FrameStats();)
+  TRC_STAGE(stats, Stage::Composite);
+  changed.clear();
+  areas.clear();
+  for (Window *window : windows) {
+    uint64_t version = window->input_version();
+    if (!window->stale && version == window->rendered_version) {
+      TRC_PROFILE_ONLY(window->stats = FrameStats();) // did nothing
+      continue;
+    }
+    window->stale = false;
+    window->rendered_version = version;
+    // a screen of another size or layout since set_backing()
+    const Screen *backing = window->backing_surface();
+    if (backing && (backing->w != window->w || backing->h != window->h ||
+                    backing->layout.kind != layout.kind))
+      window->set_backing(true);
+    changed.push_back(window);
+    areas.push_back(window->rect());
+  }
+  // a blended window goes over fresh pixels: the windows without a backing
+  // below a changed part of it are drawn again (their regions are changed
+  // too, which may reach further blended windows)
+  for (size_t k = 0; k < areas.size(); k++)
+    for (const Window *layer : windows) {
+      if (!layer->has_backing() || layer->blend == BlendMode::Copy)
+        continue;
+      Rect under = layer->rect().intersect(areas[k]);
+      if (under.empty())
+        continue;
+      for (Window *window : windows)
+        if (!window->has_backing() &&
+            !window->rect().intersect(under).empty() &&
+            std::find(changed.begin(), changed.end(), window) ==
+                changed.end()) {
+          window->stale = false;
+          window->rendered_version = window->input_version();
+          changed.push_back(window);
+          areas.push_back(window->rect());
+        }
+    }
+  ThreadPool::shared().parallel_for(0, changed.size(), 1,
+                                    [&](size_t begin, size_t end) {
+                                      for (size_t i = begin; i < end; i++)
+                                        changed[i]->render();
+                                    });
+  composite();
+  // with nobody taking them (only whole frames encoded, say) the regions
+  // would pile up frame after frame: past max_dirty, all of the screen
+  if (dirty.size() + areas.size() > max_dirty)
+    dirty.assign(1, Rect(0, 0, w, h));
+  else
+    dirty.insert(dirty.end(), areas.begin(), areas.end());
+}
+
+// copies (or blends, see Window::blend) the backed windows over the areas
+// of this frame's changed windows, lowest z first, so an area repainted by
+// a window below (backed or not) gets what lies on top of it again. the
+// screen is split into bands along its memory order, each a whole number
+// of cache lines, and the bands are copied concurrently: no two threads
+// write to the same line
+inline void Screen::composite() {
+  // by z, the same z in the order the windows were made. inserted in
+  // place: stable_sort would allocate a buffer every frame
+  layers.clear();
+  for (const Window *window : windows)
+    if (window->has_backing())
+      layers.insert(std::upper_bound(layers.begin(), layers.end(), window,
+                                     [](const Window *a, const Window *b) {
+                                       return a->z < b->z;
+                                     }),
+                    window);
+  if (layers.empty() || areas.empty())
+    return;
+  // bands of columns on column-major screens, of rows otherwise; tiled rows
+  // come a tile row at a time
+  bool columns = layout.kind == Layout::ColumnMajor;
+  size_t extent = columns ? w : h, line = columns ? h : w;
+  const size_t per_line = 64 / sizeof(uint32_t);
+  size_t unit = 1; // lines per band that end on a cache line
+  if (layout.kind == Layout::Tiled)
+    unit = FrameLayout::tile;
+  else
+    while (unit * line % per_line)
+      unit++;
+  // at least 64K pixels per band
+  size_t band = (std::max<size_t>(1, (1 << 16) / std::max<size_t>(1, line)) +
+                 unit - 1) / unit * unit;
+  ThreadPool::shared().parallel_for(
+      0, (extent + band - 1) / band, 1, [&](size_t begin, size_t end) {
+        for (size_t b = begin; b < end; b++) {
+          size_t lo = b * band, hi = std::min(extent, lo + band);
+          Rect strip = columns ? Rect(lo, 0, hi, h) : Rect(0, lo, w, hi);
+          for (const Window *layer : layers) {
+            Rect own = layer->rect().intersect(strip);
+            for (const Rect &area : areas) {
+              Rect r = own.intersect(area);
+              if (r.empty())
+                continue;
+              const Screen *from = layer->backing_surface();
+              layout.for_each_span_from(
+                  from->layout, from->pixels, r.x0 - layer->o_x,
+                  r.y0 - layer->o_y, pixels, r,
+                  [&](uint32_t *d, const uint32_t *s, size_t n) {
+                    blend_span(d, s, n, layer->blend);
+                  });
+            }
+          }
+        }
+      });
+}
+
+inline void Screen::invalidate() {
+  for (Window *window : windows)
+    window->stale = true;
+  dirty.assign(1, Rect(0, 0, w, h));
+}
+
+class Player {
+public:
+  Screen *screen;
+  LocalMiniMap *minimap = nullptr;
+  FPV *fpv = nullptr;
+  float x = 3.456; // unit: grid
+  float y = 2.345;
+  float a = 1.3; // start angle, the angle between the direction and the x-axis
+  float fov = PI / 3; // field of view
+  size_t num_laser = 512;
+  float view_dis = 20; // unit: grid, rays give up after this
+  uint32_t color = 0xFFFFFFFF;
+  Player(Screen *screen, float x = 3.456, float y = 2.345, float a = 1.3,
+         float fov = PI / 3, uint32_t color = 0xFFFFFFFF)
+      : screen(screen), x(x), y(y), a(a), fov(fov), color(color) {};
+  void walk(float step, float turn); // turn, then step forward unless a wall is close
+  // changes whenever the player's position or view does: a counter, bumped
+  // when the fields differ from the exact copy kept at the last call, so
+  // setting them directly is enough
+  uint64_t version() const;
+  FrameStats frame_stats() const; // both of the player's windows, last frame
+  // void draw_radar(float fov = PI / 3); // draw radar, the lines of sight
+  // void draw_FPV(float dis, size_t index); // draw first person view
+  //  dis: the distance to the wall
+  //  index: the index of the current laser
+  //  num_laser: the number of lasers
+  //  default: num_laser = window->minimap_w, a laser per pixel
+
+private:
+  // what version() looks at
+  struct Pose {
+    float x, y, a, fov;
+    size_t num_laser;
+    float view_dis;
+    uint32_t color;
+    bool operator==(const Pose &o) const {
+      return x == o.x && y == o.y && a == o.a && fov == o.fov &&
+             num_laser == o.num_laser && view_dis == o.view_dis &&
+             color == o.color;
+    }
+  };
+  mutable Pose seen = {};
+  mutable uint64_t changes = 0;
+};
+
+class LocalMiniMap : public Window {
+public:
+  Player *player;
+  const char *matrix;
+  size_t grid_w = 16;
+  size_t grid_h = 16;
+  size_t cell_w;
+  size_t cell_h;
+  PacketGrid packet_grid; // the matrix as the packet kernels read it
+  // built from the same matrix; when one is set, casts skip empty space
+  // with it (the field first)
+  const OccupancyPyramid *pyramid = nullptr;
+  const DistanceField *field = nullptr;
+  LocalMiniMap(const Window &window, const char *matrix, size_t grid_w = 16,
+               size_t grid_h = 16, Player *player = nullptr)
+      : LocalMiniMap(window, PacketGrid(matrix, grid_w, grid_h), player) {}
+  // shares the grid's cells, e.g. MapFile::packet_grid() for a mapped file
+  LocalMiniMap(const Window &window, const PacketGrid &grid,
+               Player *player = nullptr)
+      : Window(window), player(player), matrix(grid.cells), grid_w(grid.w),
+        grid_h(grid.h), packet_grid(grid) {
+    cell_w = w / grid_w; // not window's width but the view's width
+    cell_h = h / grid_h;
+  };
+
+  void init_ground() {
+    for (size_t j = 0; j < visible_h(); j++) {
+      uint8_t b = 255 * j / float(h);
+      if (target()->layout.kind == Layout::RowMajor) {
+        uint32_t *p = row(j);
+        for (size_t i = 0; i < visible_w(); i++)
+          p[i] = ColorUtil::pack_colors(255 * i / float(w), 0, b);
+      } else {
+        for (size_t i = 0; i < visible_w(); i++)
+          target()->at(i + target_x(), j + target_y()) =
+              ColorUtil::pack_colors(255 * i / float(w), 0, b);
+      }
+    }
+  }
+  virtual void init_wall() {
+    if (cell_w == 0 || cell_h == 0) // a map larger than the window
+      return;
+    for (size_t j = 0; j < grid_h; j++)
+      for (size_t i = 0; i < grid_w; i++) {
+        if (matrix[i + j * grid_w] == '0')
+          continue;
+        draw_rectangle_in_window(i * cell_w, j * cell_h, cell_w, cell_h,
+                                 ColorUtil::colors[matrix[i + j * grid_w] - '0']);
+      }
+  }
+
+  void draw_player() {
+    size_t px = player->x * cell_w;
+    size_t py = player->y * cell_h;
+    draw_rectangle_in_window(px, py, 5, 5,
+                             ColorUtil::pack_colors(255, 255, 255));
+  }
+
+  RayHit cast(float angle) const { return cast(cos(angle), sin(angle)); }
+  virtual RayHit cast(float dir_x, float dir_y) const {
+    if (field)
+      return cast_ray_dir(*field, matrix, player->x, player->y, dir_x, dir_y,
+                          player->view_dis);
+    if (pyramid)
+      return cast_ray_dir(*pyramid, matrix, player->x, player->y, dir_x,
+                          dir_y, player->view_dis);
+    return cast_ray_dir(matrix, grid_w, grid_h, player->x, player->y, dir_x,
+                        dir_y, player->view_dis);
+  }
+  // the rays [begin,end) of the packet at once, from the player's position
+  virtual void cast(RayPacket &packet, size_t begin, size_t end) const {
+    if (field)
+      cast_packet(*field, matrix, player->x, player->y, packet,
+                  ColorUtil::colors.data(), begin, end, player->view_dis);
+    else if (pyramid)
+      cast_packet(*pyramid, matrix, player->x, player->y, packet,
+                  ColorUtil::colors.data(), begin, end, player->view_dis);
+    else
+      cast_packet(matrix, packet_grid, player->x, player->y, packet,
+                  ColorUtil::colors.data(), begin, end, player->view_dis);
+  }
+
+  // paints the path of a laser that stops after dis
+  void draw_laser(float angle, float dis, const uint32_t color) {
+    draw_laser(cos(angle), sin(angle), dis, color);
+  }
+  // (dx,dy): a unit direction. one line from the player to where the
+  // laser stops, in pixel coordinates
+  void draw_laser(float dx, float dy, float dis, const uint32_t color) {
+    draw_line(long(std::floor(player->x * cell_w)),
+              long(std::floor(player->y * cell_h)),
+              long(std::floor((player->x + dis * dx) * cell_w)),
+              long(std::floor((player->y + dis * dy) * cell_h)), color);
+  }
+
+  float shoot_laser(float angle, const uint32_t color, uint32_t& brick_color,  bool draw = true) {
+    RayHit hit = cast(angle);
+    brick_color = hit.hit ? ColorUtil::colors[hit.cell - '0']
+                          : ColorUtil::pack_colors(0, 0, 0);
+    if (draw) // the map is only looked up by the cast, this just paints the path
+      draw_laser(angle, hit.dis, color);
+    return hit.dis;
+  }
+
+  void draw_radar() {
+    radar_view.set(player->fov, player->num_laser);
+    radar.resize(radar_view.size());
+    radar_x.resize(radar_view.size());
+    radar_y.resize(radar_view.size());
+    {
+      TRC_STAGE(stats, Stage::Cast);
+      radar_view.directions(player->a, radar_x.data(), radar_y.data());
+      for (size_t i = 0; i < radar.size(); i++)
+        radar[i] = cast(radar_x[i], radar_y[i]);
+    }
+    TRC_PROFILE_ONLY(for (const RayHit &hit : radar) {
+      stats.rays++;
+      stats.ray_steps += hit.steps;
+      stats.cells_visited += hit.cells;
+    })
+    TRC_STAGE(stats, Stage::Fill);
+    for (size_t i = 0; i < radar.size(); i++)
+      draw_laser(radar_x[i], radar_y[i], radar[i].dis,
+                 ColorUtil::pack_colors(255, 255, 255));
+  }
+
+  // the ground and the walls, the part of the minimap that never moves.
+  // painted once into the screen and kept as a copy of the window's pixels;
+  // every frame starts from that copy
+  void restore_background() {
+    Rect area = target_rect();
+    const FrameLayout &layout = target()->layout;
+    if (background.size() != area.w() * area.h() ||
+        background_layout.w != layout.w ||
+        background_layout.h != layout.h ||
+        background_layout.kind != layout.kind) {
+      init_ground();
+      init_wall();
+      background.resize(area.w() * area.h());
+      layout.read_rows(target()->pixels, area.y0, area.y1,
+                       background.data(), area.x0, area.x1);
+      background_layout = layout;
+    } else {
+      layout.write_rows(target()->pixels, area.y0, area.y1,
+                        background.data(), area.x0, area.x1);
+    }
+    TRC_PROFILE_ONLY(stats.pixels_written += background.size();)
+  }
+  // call after changing the map or the palette
+  void invalidate_background() { background.clear(); }
+
+  void render() override {
+    TRC_PROFILE_ONLY(stats = FrameStats();)
+    {
+      TRC_STAGE(stats, Stage::Fill);
+      restore_background();
+      draw_player();
+    }
+    draw_radar();
+  }
+  const char *name() const override { return "LocalMiniMap"; }
+  uint64_t input_version() const override { return player->version(); }
+
+private:
+  ViewTable radar_view;
+  std::vector<RayHit> radar; // the radar's hits, reused between frames
+  std::vector<float> radar_x; // and their directions
+  std::vector<float> radar_y;
+  std::vector<uint32_t> background; // row-major, the window's visible part
+  FrameLayout background_layout;     // of the screen it was taken from
+};
+
+// a LocalMiniMap whose map and window sizes are fixed when compiling, like
+// the built-in 16x16 map in a 512x512 window: its casts (the FPV's among
+// them) index cells with constant bounds and, for power-of-two widths,
+// shifts, and the walls are painted in loops of constant length. with a
+// pyramid or a field it casts as LocalMiniMap does
+template <size_t GridW, size_t GridH, size_t ViewW, size_t ViewH>
+class StaticMiniMap : public LocalMiniMap {
+public:
+  static constexpr size_t static_cell_w = ViewW / GridW;
+  static constexpr size_t static_cell_h = ViewH / GridH;
+
+  // grid: GridW x GridH cells, window: ViewW x ViewH pixels
+  StaticMiniMap(const Window &window, const PacketGrid &grid,
+                Player *player = nullptr)
+      : LocalMiniMap(window, grid, player) {
+    assert(grid.w == GridW && grid.h == GridH);
+    assert(w == ViewW && h == ViewH);
+  }
+
+  using LocalMiniMap::cast;
+  RayHit cast(float dir_x, float dir_y) const override {
+    if (field || pyramid)
+      return LocalMiniMap::cast(dir_x, dir_y);
+    return cast_ray_dir<GridW, GridH>(matrix, player->x, player->y, dir_x,
+                                      dir_y, player->view_dis);
+  }
+  void cast(RayPacket &packet, size_t begin, size_t end) const override {
+    if (field || pyramid)
+      return LocalMiniMap::cast(packet, begin, end);
+    cast_packet<GridW, GridH>(packet_grid, player->x, player->y, packet,
+                              ColorUtil::colors.data(), begin, end,
+                              player->view_dis);
+  }
+
+  void init_wall() override {
+    if (static_cell_w == 0 || static_cell_h == 0)
+      return;
+    for (size_t j = 0; j < GridH; j++)
+      for (size_t i = 0; i < GridW; i++) {
+        char cell = matrix[i + j * GridW];
+        if (cell != '0')
+          draw_rectangle_in_window(i * static_cell_w, j * static_cell_h,
+                                   static_cell_w, static_cell_h,
+                                   ColorUtil::colors[cell - '0']);
+      }
+  }
+};
+
+class FPV : public Window {
+public:
+  Player *player;
+  RayPacket packet; // kept between frames to reuse the allocations
+  ViewTable view;   // the directions of the columns
+  // wall textures by material, flat palette colors without (or for
+  // materials past its end)
+  const TextureAtlas *textures = nullptr;
+  // drawn over the walls, hidden where a wall is closer
+  const SpriteSet *sprites = nullptr;
+  FPV(Window &window, Player *player,
+      Projection projection = Projection::Angular)
+      : Window(window), player(player), projection(projection) {
+  };
+  void set_projection(Projection projection) {
+    this->projection = projection;
+    stale = true;
+  }
+  uint32_t ceiling_color = ColorUtil::pack_colors(0, 0, 0);
+  uint32_t floor_color = ColorUtil::pack_colors(0, 0, 0);
+  void draw_FPV(size_t i,float dis,uint32_t color = ColorUtil::pack_colors(255, 255, 255)) {
+    // a wall slice of height h/dis, centered; closer than 1 it overflows the
+    // window and gets clipped. a hit right at the player (dis 0) is clamped,
+    // as AgentBatch does, so the height stays finite
+    dis = std::max(dis, 1e-6f);
+    long top = long(float(h) / 2.0 * (1.0 - 1.0 / dis));
+    long height = long(float(h) / dis);
+    draw_column(i, top, top + height, ceiling_color, color, floor_color);
+  }
+  // the same slice with texture column u (0..1) of a material
+  void draw_FPV(size_t i, float dis, int32_t material, float u) {
+    dis = std::max(dis, 1e-6f);
+    long top = long(float(h) / 2.0 * (1.0 - 1.0 / dis));
+    long height = long(float(h) / dis);
+    size_t n = textures->size();
+    size_t column = std::min(size_t(u * n), n - 1);
+    draw_textured_column(i, top, top + height, ceiling_color,
+                         textures->column(material, column), n, floor_color);
+  }
+  void render() override {
+    TRC_PROFILE_ONLY(stats = FrameStats();)
+    ThreadPool &pool = ThreadPool::shared();
+    // columns facing a near wall are cheap, open corridors are not:
+    // small tiles let the pool even that out
+    {
+      TRC_STAGE(stats, Stage::Cast);
+      view.set(player->fov, w, projection); // one ray per column
+      packet.set_view(view, player->a);
+      pool.parallel_for(0, w, 64, [this](size_t begin, size_t end) {
+        player->minimap->cast(packet, begin, end);
+      });
+    }
+    {
+      TRC_STAGE(stats, Stage::Fill);
+      pool.parallel_for(0, w, 64, [this](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          int32_t material = packet.material[i];
+          if (textures && material > 0 && size_t(material) < textures->count())
+            draw_FPV(i, packet.dis[i], material,
+                     wall_u(player->x, player->y, packet.dir_x[i],
+                            packet.dir_y[i], packet.dis[i],
+                            WallSide(packet.side[i])));
+          else
+            draw_FPV(i, packet.dis[i], packet.color[i]);
+        }
+      });
+    }
+    if (sprites && sprites->count()) {
+      TRC_STAGE(stats, Stage::Fill);
+      sprite_view.project(*sprites, player->x, player->y, player->a,
+                          player->fov, projection, w, h, player->view_dis);
+      pool.parallel_for(0, w, 64, [this](size_t begin, size_t end) {
+        draw_sprites(begin, end);
+      });
+    }
+    TRC_PROFILE_ONLY({
+      stats.rays = w;
+      for (size_t i = 0; i < w; i++) {
+        stats.ray_steps += packet.steps[i];
+        stats.cells_visited += packet.cells[i];
+      }
+      stats.pixels_written = std::min(w, visible_w()) * visible_h();
+    })
+  }
+  // the columns [begin,end) of the sprites, back to front. a column is
+  // drawn where the sprite is nearer than the wall that column's ray hit,
+  // the rays' distances being the depth buffer. sprites are discs
+  void draw_sprites(size_t begin, size_t end) {
+    const std::vector<float> &depth = packet.dis;
+    long vis_h = long(visible_h());
+    // a sprite behind the farthest wall of these columns is hidden in all
+    float farthest =
+        *std::max_element(depth.begin() + begin, depth.begin() + end);
+    for (const ProjectedSprite &s : sprite_view.sprites()) {
+      long x0 = std::max(long(begin), s.x0());
+      long x1 = std::min(long(end), s.x1());
+      if (x0 >= x1 || !(s.depth < farthest))
+        continue;
+      float mid = (s.top + s.bottom) / 2.0f, radius = (s.bottom - s.top) / 2.0f;
+      for (long x = x0; x < x1; x++) {
+        if (!(s.depth < depth[x]) || size_t(x) >= visible_w())
+          continue;
+        float t = (x - s.center) / s.half_w;
+        float half = radius * std::sqrt(std::max(0.0f, 1 - t * t));
+        long top = std::max(0L, long(mid - half));
+        long bottom = std::min(vis_h, long(mid + half));
+        if (top < bottom)
+          target()->fill_column(x + target_x(), top + target_y(),
+                                bottom + target_y(), s.color);
+      }
+    }
+  }
+
+  const char *name() const override { return "FPV"; }
+  // a counter as well: the player's and the sprites' versions are kept
+  // rather than mixed, which could make two different inputs look the same
+  uint64_t input_version() const override {
+    uint64_t player_now = player->version();
+    uint64_t sprites_now = sprites ? sprites->version() + 1 : 0;
+    if (player_now != seen_player || sprites_now != seen_sprites) {
+      seen_player = player_now;
+      seen_sprites = sprites_now;
+      changes++;
+    }
+    return changes;
+  }
+
+private:
+  Projection projection;
+  mutable uint64_t seen_player = 0, seen_sprites = 0, changes = 0;
+  SpriteView sprite_view;
+};
+
+// one step of a flythrough: the view's center is a + fov / 2
+inline void Player::walk(float step, float turn) {
+  a += turn;
+  float center = a + fov / 2;
+  if (minimap->cast(center).dis > 1 + step) {
+    x += step * cos(center);
+    y += step * sin(center);
+  }
+}
+
+inline uint64_t Player::version() const {
+  Pose now = {x, y, a, fov, num_laser, view_dis, color};
+  if (!(now == seen)) {
+    seen = now;
+    changes++;
+  }
+  return changes;
+}
+
+inline FrameStats Player::frame_stats() const {
+  FrameStats stats;
+  if (minimap)
+    stats += minimap->stats;
+  if (fpv)
+    stats += fpv->stats;
+  return stats;
+}
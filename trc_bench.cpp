@@ -0,0 +1,494 @@
+// microbenchmarks for the hot kernels, printed as JSON:
+//   trc_bench [--min-time seconds] [--quick]
+// every entry names the kernel, its parameters and a rate. compare the
+// output of two builds to catch regressions
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+
+#include "agents.h"
+#include "trc.h"
+
+namespace {
+
+double min_time = 0.2; // seconds per measurement
+std::vector<std::string> results;
+volatile float sink; // keeps results alive
+
+// runs fn (which does `work` units per call) until min_time has passed,
+// returns units per second
+template <typename Fn> double measure(double work, Fn fn) {
+  typedef std::chrono::steady_clock clock;
+  fn(); // warm up
+  size_t calls = 0;
+  clock::time_point start = clock::now();
+  double elapsed = 0;
+  do {
+    fn();
+    calls++;
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  } while (elapsed < min_time);
+  return work * calls / elapsed;
+}
+
+void report(const std::string &kernel, const std::string &params, double rate,
+            const std::string &unit) {
+  std::ostringstream entry;
+  entry << "{\"kernel\": \"" << kernel << "\", " << params
+        << (params.empty() ? "" : ", ") << "\"rate\": " << rate
+        << ", \"unit\": \"" << unit << "\"}";
+  results.push_back(entry.str());
+  std::cerr << entry.str() << std::endl; // progress
+}
+
+const char *simd_name(SimdLevel level) {
+  return level == SimdLevel::AVX2    ? "avx2"
+         : level == SimdLevel::SSE41 ? "sse4.1"
+                                     : "scalar";
+}
+const char *layout_name(Layout kind) {
+  return kind == Layout::ColumnMajor ? "column"
+         : kind == Layout::Tiled     ? "tiled"
+                                     : "row";
+}
+
+// a square map with a border and one random wall in every `sparsity` cells
+std::string random_map(size_t n, unsigned seed, int sparsity = 10) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<> wall(0, sparsity - 1);
+  std::string map(n * n, '0');
+  for (size_t j = 0; j < n; j++)
+    for (size_t i = 0; i < n; i++) {
+      bool border = i == 0 || j == 0 || i == n - 1 || j == n - 1;
+      if (border || wall(gen) == 0)
+        map[i + j * n] = char('1' + gen() % 9);
+    }
+  map[n / 2 + n / 2 * n] = '0'; // the player stands here
+  return map;
+}
+
+// cast_packet on an n x n map with n fixed when compiling
+template <size_t N>
+void cast_packet_n(const PacketGrid &grid, float x, float y, RayPacket &p,
+                   SimdLevel level) {
+  cast_packet<N, N>(grid, x, y, p, ColorUtil::colors.data(), 0, p.size(), 20,
+                    level);
+}
+typedef void (*CastPacketFn)(const PacketGrid &, float, float, RayPacket &,
+                             SimdLevel);
+// the instance for an n x n map, null for sizes bench_casting has none for
+CastPacketFn cast_packet_static(size_t n) {
+  switch (n) {
+  case 16:
+    return cast_packet_n<16>;
+  case 64:
+    return cast_packet_n<64>;
+  case 256:
+    return cast_packet_n<256>;
+  case 1024:
+    return cast_packet_n<1024>;
+  }
+  return nullptr;
+}
+
+void bench_casting(const std::vector<size_t> &map_sizes,
+                   const std::vector<size_t> &ray_counts,
+                   const std::vector<float> &fovs) {
+  for (size_t n : map_sizes) {
+    std::string map = random_map(n, unsigned(n));
+    Screen screen(512, 512);
+    Window window(&screen, 0, 0, 512, 512);
+    Player player(&screen, n / 2 + 0.5f, n / 2 + 0.5f, 0.3f);
+    LocalMiniMap minimap(window, map.c_str(), n, n, &player);
+    player.minimap = &minimap;
+    for (size_t rays : ray_counts)
+      for (float fov : fovs) {
+        std::ostringstream params;
+        params << "\"map\": " << n << ", \"rays\": " << rays
+               << ", \"fov\": " << fov;
+        double rate = measure(rays, [&] {
+          float a = player.a;
+          for (size_t i = 0; i < rays; i++, a += fov / rays)
+            sink = minimap.cast(a).dis;
+        });
+        report("shoot_laser", params.str(), rate, "rays/s");
+
+        RayPacket packet;
+        packet.set_fan(player.a, fov / rays, rays);
+        for (SimdLevel level :
+             {SimdLevel::Scalar, SimdLevel::SSE41, SimdLevel::AVX2}) {
+          if (level > simd_level())
+            continue;
+          rate = measure(rays, [&] {
+            cast_packet(minimap.matrix, minimap.packet_grid, player.x,
+                        player.y, packet, ColorUtil::colors.data(), 20, level);
+            sink = packet.dis[0];
+          });
+          report("cast_packet",
+                 params.str() + ", \"simd\": \"" + simd_name(level) + "\"",
+                 rate, "rays/s");
+          CastPacketFn cast_static = cast_packet_static(n);
+          if (!cast_static)
+            continue;
+          rate = measure(rays, [&] {
+            cast_static(minimap.packet_grid, player.x, player.y, packet,
+                        level);
+            sink = packet.dis[0];
+          });
+          report("cast_packet_static",
+                 params.str() + ", \"simd\": \"" + simd_name(level) + "\"",
+                 rate, "rays/s");
+        }
+      }
+  }
+}
+
+// long rays: on open maps the view distance is what bounds a ray, unless
+// empty space is skipped. sparsity: one wall in that many cells
+void bench_view_distance(const std::vector<size_t> &map_sizes) {
+  const size_t rays = 1024;
+  for (size_t n : map_sizes)
+    for (int sparsity : {100, 100000}) {
+      std::string map = random_map(n, unsigned(n), sparsity);
+      OccupancyPyramid pyramid(map.c_str(), n, n);
+      DistanceField field(map.c_str(), n, n);
+      std::ostringstream map_params;
+      map_params << "\"map\": " << n << ", \"sparsity\": " << sparsity;
+      report("build_pyramid", map_params.str(), measure(double(n) * n, [&] {
+               OccupancyPyramid built(map.c_str(), n, n);
+             }),
+             "cells/s");
+      report("build_distance_field", map_params.str(),
+             measure(double(n) * n,
+                     [&] { sink = DistanceField(map.c_str(), n, n).at(0, 0); }),
+             "cells/s");
+      Screen screen(512, 512);
+      Window window(&screen, 0, 0, 512, 512);
+      Player player(&screen, n / 2 + 0.5f, n / 2 + 0.5f, 0.3f);
+      LocalMiniMap minimap(window, map.c_str(), n, n, &player);
+      player.minimap = &minimap;
+      for (float view : {20.0f, float(n)})
+        for (std::string engine : {"dda", "pyramid", "sdf"}) {
+          player.view_dis = view;
+          minimap.pyramid = engine == "pyramid" ? &pyramid : nullptr;
+          minimap.field = engine == "sdf" ? &field : nullptr;
+          std::ostringstream params;
+          params << map_params.str() << ", \"view\": " << view
+                 << ", \"engine\": \"" << engine << "\"";
+          double rate = measure(rays, [&] {
+            float a = player.a;
+            for (size_t i = 0; i < rays; i++, a += float(2 * PI) / rays)
+              sink = minimap.cast(a).dis;
+          });
+          report("cast_view_distance", params.str(), rate, "rays/s");
+        }
+    }
+}
+
+void bench_fpv(const std::vector<size_t> &widths) {
+  std::string map = random_map(64, 64);
+  for (size_t w : widths) {
+    size_t h = w / 2;
+    Screen screen(2 * w, h);
+    Window left(&screen, 0, 0, w, h), right(&screen, w, 0, w, h);
+    Player player(&screen, 32.5f, 32.5f, 0.3f);
+    LocalMiniMap minimap(left, map.c_str(), 64, 64, &player);
+    FPV fpv(right, &player);
+    player.minimap = &minimap;
+    player.fpv = &fpv;
+    std::ostringstream params;
+    params << "\"width\": " << w << ", \"height\": " << h
+           << ", \"threads\": " << ThreadPool::shared().size();
+    report("fpv_render", params.str(), measure(w, [&] { fpv.render(); }),
+           "columns/s");
+    TextureAtlas textures =
+        TextureAtlas::bricks(ColorUtil::colors.data(), 10);
+    fpv.textures = &textures;
+    report("fpv_render_textured", params.str(),
+           measure(w, [&] { fpv.render(); }), "columns/s");
+    fpv.textures = nullptr;
+
+    // thousands of billboards around the player, most of them behind walls
+    SpriteSet sprites;
+    std::mt19937 gen(static_cast<unsigned>(w));
+    std::uniform_real_distribution<float> coord(1, 63);
+    for (size_t i = 0; i < 4096; i++)
+      sprites.add(coord(gen), coord(gen), 0.5f, 0xFF00D7FF);
+    SpriteView view;
+    report("project_sprites", params.str() + ", \"sprites\": 4096",
+           measure(sprites.count(), [&] {
+             view.project(sprites, player.x, player.y, player.a, player.fov,
+                          Projection::Angular, w, h, player.view_dis);
+             sink = float(view.sprites().size());
+           }),
+           "sprites/s");
+    fpv.sprites = &sprites;
+    report("fpv_render_sprites", params.str() + ", \"sprites\": 4096",
+           measure(w, [&] { fpv.render(); }), "columns/s");
+    fpv.sprites = nullptr;
+
+    // as many agents as it takes to cast w * 64 rays, 64 columns each, with
+    // and without their pixels
+    {
+      const size_t agents = w, columns = 64;
+      std::vector<float> xs(agents), ys(agents), as(agents);
+      std::vector<float> dis(agents * columns);
+      std::vector<int32_t> material(agents * columns);
+      std::vector<uint8_t> rgb(agents * columns * columns * 3);
+      std::uniform_real_distribution<float> angle(0, float(2 * PI));
+      for (size_t k = 0; k < agents; k++) {
+        do {
+          xs[k] = coord(gen);
+          ys[k] = coord(gen);
+        } while (map[size_t(xs[k]) + size_t(ys[k]) * 64] != '0');
+        as[k] = angle(gen);
+      }
+      AgentBatch batch(PacketGrid(map.c_str(), 64, 64),
+                       ColorUtil::colors.data());
+      AgentOutputs out;
+      out.dis = dis.data();
+      out.material = material.data();
+      std::ostringstream agent_params;
+      agent_params << "\"agents\": " << agents << ", \"columns\": " << columns
+                   << ", \"threads\": " << ThreadPool::shared().size();
+      report("cast_agents", agent_params.str() + ", \"rows\": 0",
+             measure(double(agents) * columns, [&] {
+               batch.cast(agents, xs.data(), ys.data(), as.data(), player.fov,
+                          columns, out);
+             }),
+             "rays/s");
+      out.rgb = rgb.data();
+      out.rows = columns;
+      report("cast_agents", agent_params.str() + ", \"rows\": 64",
+             measure(double(agents) * columns, [&] {
+               batch.cast(agents, xs.data(), ys.data(), as.data(), player.fov,
+                          columns, out);
+             }),
+             "rays/s");
+    }
+
+    // the column setup alone: a sin/cos per column, or the cached views
+    RayPacket packet;
+    report("set_fan", params.str(), measure(w, [&] {
+             packet.set_fan(player.a, player.fov / w, w);
+             sink = packet.dir_x[w - 1];
+           }),
+           "columns/s");
+    for (Projection projection : {Projection::Angular, Projection::Planar}) {
+      ViewTable view;
+      view.set(player.fov, w, projection);
+      report("set_view",
+             params.str() + ", \"projection\": \"" +
+                 (projection == Projection::Planar ? "planar" : "angular") +
+                 "\"",
+             measure(w, [&] {
+               packet.set_view(view, player.a);
+               sink = packet.dir_x[w - 1];
+             }),
+             "columns/s");
+    }
+  }
+}
+
+void bench_filling(const std::vector<size_t> &screen_sizes) {
+  std::string map = random_map(16, 16);
+  for (size_t n : screen_sizes)
+    for (Layout kind : {Layout::RowMajor, Layout::ColumnMajor, Layout::Tiled}) {
+      Screen screen(n, n, kind);
+      Window window(&screen, 0, 0, n, n);
+      std::ostringstream params;
+      params << "\"screen\": " << n << ", \"layout\": \"" << layout_name(kind)
+             << "\"";
+      for (size_t rect : {size_t(1), size_t(8), size_t(64), n}) {
+        double pixels = double(rect) * rect;
+        size_t count = std::max<size_t>(1, 4096 / (rect * rect));
+        double rate = measure(pixels * count, [&] {
+          for (size_t k = 0; k < count; k++)
+            window.draw_rectangle_in_window((k * 37) % (n - rect + 1),
+                                            (k * 91) % (n - rect + 1), rect,
+                                            rect, 0xFF00FF00 + k);
+        });
+        std::ostringstream rect_params;
+        rect_params << params.str() << ", \"rect\": " << rect;
+        report("draw_rectangle_in_window", rect_params.str(), rate,
+               "pixels/s");
+      }
+      double rate = measure(double(n) * n, [&] {
+        for (size_t x = 0; x < n; x++)
+          window.draw_column(x, long(n / 4), long(3 * n / 4), 1, 2, 3);
+      });
+      report("draw_column", params.str(), rate, "pixels/s");
+      // a fan of lines from the centre out past the borders, clipped
+      rate = measure(128.0 * n, [&] { // about n / 2 pixels each
+        for (long k = 0; k < 256; k++)
+          window.draw_line(long(n / 2), long(n / 2),
+                           long(n / 2) + long(n) * (k % 16 - 8) / 8,
+                           long(n / 2) + long(n) * (k / 16 - 8) / 8,
+                           0xFF00FF00 + uint32_t(k));
+      });
+      report("draw_line", params.str(), rate, "pixels/s");
+
+      Player player(&screen);
+      LocalMiniMap minimap(window, map.c_str(), 16, 16, &player);
+      report("init_ground", params.str(),
+             measure(double(n) * n, [&] { minimap.init_ground(); }),
+             "pixels/s");
+      report("init_wall", params.str(),
+             measure(double(n) * n, [&] { minimap.init_wall(); }), "pixels/s");
+      minimap.restore_background(); // the first call paints and keeps it
+      report("restore_background", params.str(),
+             measure(double(n) * n, [&] { minimap.restore_background(); }),
+             "pixels/s");
+      player.x = player.y = 7.5f;
+      report("draw_radar", params.str(),
+             measure(double(player.num_laser), [&] { minimap.draw_radar(); }),
+             "rays/s");
+
+      // four backed quadrants copied into a screen of their own, all changed
+      Screen composited(n, n, kind);
+      std::vector<std::unique_ptr<Window>> quadrants;
+      for (size_t q = 0; q < 4; q++) {
+        quadrants.emplace_back(new Window(&composited, q % 2 * (n / 2),
+                                          q / 2 * (n / 2), n / 2, n / 2));
+        quadrants.back()->set_backing(true);
+      }
+      report("composite", params.str(), measure(double(n) * n, [&] {
+               composited.invalidate();
+               composited.render();
+             }),
+             "pixels/s");
+    }
+}
+
+void bench_encoding(const std::vector<size_t> &screen_sizes) {
+  for (size_t n : screen_sizes)
+    for (Layout kind : {Layout::RowMajor, Layout::ColumnMajor, Layout::Tiled}) {
+      Screen screen(n, n, kind);
+      for (size_t i = 0; i < screen.buffer.size(); i++)
+        screen.buffer[i] = uint32_t(i * 2654435761u);
+      std::ostringstream params;
+      params << "\"screen\": " << n << ", \"layout\": \"" << layout_name(kind)
+             << "\"";
+      double mb = ppm_size(n, n) / 1e6;
+      std::vector<uint8_t> out(ppm_size(n, n));
+      report("encode_ppm", params.str(), measure(mb, [&] {
+               encode_ppm(screen.buffer.data(), screen.layout, out.data());
+             }),
+             "MB/s");
+      const std::string path = "./trc_bench.ppm";
+      report("to_ppm", params.str(), measure(mb, [&] {
+               screen.invalidate(); // all of it, as after a full repaint
+               screen.to_ppm(path);
+             }),
+             "MB/s");
+      std::remove(path.c_str());
+
+      // the compressed formats, on noise (the worst case) and on a frame
+      // like the renderer's: a gradient, flat column slices below it
+      QoiEncoder qoi;
+      PngEncoder png;
+      for (const char *content : {"noise", "walls"}) {
+        if (std::string(content) == "walls")
+          for (size_t y = 0; y < n; y++)
+            for (size_t x = 0; x < n; x++)
+              screen.at(x, y) =
+                  y < n / 2 ? ColorUtil::pack_colors(255 * x / n, 0, 255 * y / n)
+                            : ColorUtil::colors[x / 37 % 16];
+        std::string content_params =
+            params.str() + ", \"content\": \"" + content + "\"";
+        report("encode_qoi", content_params, measure(mb, [&] {
+                 qoi.encode(screen.pixels, screen.layout,
+                            [](const uint8_t *, size_t) { return true; });
+               }),
+               "MB/s");
+        report("encode_png", content_params, measure(mb, [&] {
+                 png.encode(screen.pixels, screen.layout,
+                            [](const uint8_t *, size_t) { return true; });
+               }),
+               "MB/s");
+      }
+    }
+}
+
+const char *blend_name(BlendMode mode) {
+  return mode == BlendMode::SourceOver ? "source_over"
+         : mode == BlendMode::Additive ? "additive"
+                                       : "multiply";
+}
+
+// one row of a translucent overlay over an opaque one, both in L1/L2
+void bench_blending(const std::vector<size_t> &widths) {
+  for (size_t n : widths) {
+    std::vector<uint32_t> dst(n), src(n);
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = 0xFF000000 | uint32_t(i * 2654435761u);
+      src[i] = uint32_t(i * 40503u) << 8 | uint32_t(i & 255) << 24;
+    }
+    for (BlendMode mode :
+         {BlendMode::SourceOver, BlendMode::Additive, BlendMode::Multiply})
+      for (SimdLevel level :
+           {SimdLevel::Scalar, SimdLevel::SSE41, SimdLevel::AVX2}) {
+        if (level > simd_level())
+          continue;
+        std::ostringstream params;
+        params << "\"pixels\": " << n << ", \"mode\": \"" << blend_name(mode)
+               << "\", \"simd\": \"" << simd_name(level) << "\"";
+        report("blend_span", params.str(), measure(double(n), [&] {
+                 blend_span(dst.data(), src.data(), n, mode, level);
+               }),
+               "pixels/s");
+        report("blend_fill", params.str(), measure(double(n), [&] {
+                 blend_fill(dst.data(), 0x80FF8040, n, mode, level);
+               }),
+               "pixels/s");
+      }
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  bool quick = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--min-time" && i + 1 < argc) {
+      min_time = std::atof(argv[++i]);
+    } else if (arg == "--quick") {
+      quick = true;
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--min-time seconds] [--quick]"
+                << std::endl;
+      return 1;
+    }
+  }
+  std::mt19937 gen(42); // fixed palette: runs stay comparable
+  for (int i = 0; i < 256; i++)
+    ColorUtil::colors.push_back(
+        ColorUtil::pack_colors(gen() % 256, gen() % 256, gen() % 256));
+
+  if (quick) {
+    bench_casting({16, 256}, {512}, {float(PI / 3)});
+    bench_view_distance({1024});
+    bench_fpv({512});
+    bench_filling({512});
+    bench_encoding({512});
+    bench_blending({4096});
+  } else {
+    bench_casting({16, 64, 256, 1024}, {256, 1024, 4096},
+                  {float(PI / 3), float(PI / 2)});
+    bench_view_distance({256, 1024, 4096});
+    bench_fpv({512, 1024, 2048, 3840});
+    bench_filling({512, 1024, 2048});
+    bench_encoding({512, 1024, 2048});
+    bench_blending({1024, 65536});
+  }
+
+  std::cout << "{\n  \"simd\": \"" << simd_name(simd_level())
+            << "\",\n  \"threads\": " << ThreadPool::shared().size()
+            << ",\n  \"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); i++)
+    std::cout << "    " << results[i] << (i + 1 < results.size() ? "," : "")
+              << "\n";
+  std::cout << "  ]\n}" << std::endl;
+  return 0;
+}
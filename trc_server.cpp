@@ -0,0 +1,611 @@
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "map_file.h"
+#include "trc.h"
+
+// trc_server [--map file] [--engine dda|pyramid|sdf] [--socket path]
+//            [--slots N] [--max-size WxH] [--shm name]
+// renders first-person views on request, for as long as it runs: the map
+// is loaded (and its acceleration structure built) once, renderers stay
+// warm between requests, and frames reach the client through shared
+// memory, written there by the renderer itself.
+//
+// one line per message, on stdin/stdout, or with --socket from any number
+// of clients on a Unix domain socket:
+//   render TAG X Y ANGLE FOV W H -> frame TAG SLOT OFFSET W H
+//                                   or error TAG what
+//   release SLOT                 -> nothing, the client is done with SLOT
+//   quit                         -> the connection is closed
+// (X,Y): the viewpoint, unit: grid. ANGLE: the direction of the view's
+// center and FOV its width, radians. TAG: anything without spaces, echoed.
+// first thing, the server prints: ready SHM_NAME SLOTS SLOT_BYTES.
+// a frame is W * H pixels 0xAABBGGRR (bytes R,G,B,A), row after row, at
+// OFFSET in the POSIX shared memory object SHM_NAME, and stays there until
+// the client releases the slot. requests that arrive together are rendered
+// together, each on a thread of the pool, as many as there are free slots;
+// the rest wait for a release (a connection's slots are released when it
+// closes). a client that has stopped sending can release nothing, so once
+// no slot is free its remaining requests get: error TAG no free slot
+
+#if TRC_POSIX_IO
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace {
+
+// set by SIGINT/SIGTERM, which only the main thread takes: its read() or
+// accept() fails with EINTR, and main() removes the shared memory object
+// and the socket. nothing else is safe to do in the handler itself
+volatile sig_atomic_t stop_signal = 0;
+
+void request_stop(int signal) { stop_signal = signal; }
+
+// everything that depends on the map only, built once
+struct World {
+  PacketGrid grid;
+  std::unique_ptr<OccupancyPyramid> pyramid;
+  std::unique_ptr<DistanceField> field;
+  TextureAtlas textures;
+};
+
+// one renderer of one resolution: a screen holding just the view, with no
+// pixels of its own (it draws into the slot it is given), and the minimap
+// the view casts through (never drawn, it has no pixels either)
+class View {
+public:
+  View(const World &world, size_t w, size_t h)
+      : screen(w, h, nullptr), map_window(&screen, 0, 0, 0, 0),
+        fpv_window(&screen, 0, 0, w, h), player(&screen),
+        minimap(map_window, world.grid, &player), fpv(fpv_window, &player) {
+    player.minimap = &minimap;
+    player.fpv = &fpv;
+    minimap.pyramid = world.pyramid.get();
+    minimap.field = world.field.get();
+    fpv.textures = &world.textures;
+  }
+
+  // into out, w * h row-major pixels
+  void render(float x, float y, float angle, float fov, uint32_t *out) {
+    player.x = x;
+    player.y = y;
+    player.a = angle - fov / 2; // the first column's ray
+    player.fov = fov;
+    screen.attach(out);
+    fpv.render();
+    screen.detach();
+  }
+
+private:
+  Screen screen;
+  Window map_window;
+  Window fpv_window;
+  Player player;
+  LocalMiniMap minimap;
+  FPV fpv;
+};
+
+// idle renderers by resolution, so a request rarely builds one. at most
+// capacity are kept; past that the one used longest ago goes, so clients
+// cycling through sizes don't pile up renderers
+class ViewCache {
+public:
+  ViewCache(const World &world, size_t capacity)
+      : world(world), capacity(capacity) {}
+  std::unique_ptr<View> take(size_t w, size_t h) {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      for (auto it = idle.begin(); it != idle.end(); ++it)
+        if (it->w == w && it->h == h) {
+          std::unique_ptr<View> view = std::move(it->view);
+          idle.erase(it);
+          return view;
+        }
+    }
+    return std::unique_ptr<View>(new View(world, w, h));
+  }
+  void give_back(size_t w, size_t h, std::unique_ptr<View> view) {
+    std::unique_ptr<View> evicted; // destroyed after unlocking
+    std::lock_guard<std::mutex> lock(m);
+    idle.push_front(Idle{w, h, std::move(view)});
+    if (idle.size() > capacity) {
+      evicted = std::move(idle.back().view);
+      idle.pop_back();
+    }
+  }
+
+private:
+  struct Idle {
+    size_t w, h;
+    std::unique_ptr<View> view;
+  };
+  const World &world;
+  const size_t capacity;
+  std::mutex m;
+  std::list<Idle> idle; // the most recently used first
+};
+
+// the shared memory object, cut into equal slots that the clients own
+// between a frame and its release
+class SlotPool {
+public:
+  ~SlotPool() { close(); }
+
+  bool open(const std::string &name, size_t count, size_t bytes) {
+    this->name = name;
+    slot_bytes = (bytes + 4095) / 4096 * 4096; // slots start on pages
+    owner.assign(count, -1);
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+      return false;
+    size = count * slot_bytes;
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, off_t(size)) == 0)
+      p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd); // the mapping keeps the object
+    if (p == MAP_FAILED) {
+      shm_unlink(name.c_str());
+      return false;
+    }
+    base = (uint8_t *)p;
+    return true;
+  }
+  void close() {
+    if (!base)
+      return;
+    munmap(base, size);
+    shm_unlink(name.c_str());
+    base = nullptr;
+  }
+
+  size_t count() const { return owner.size(); }
+  size_t bytes() const { return slot_bytes; }
+  uint32_t *at(size_t slot) { return (uint32_t *)(base + slot * slot_bytes); }
+
+  // a free slot, now owned by client; false when there is none
+  bool try_acquire(long client, size_t &slot) {
+    std::lock_guard<std::mutex> lock(m);
+    for (size_t i = 0; i < owner.size(); i++)
+      if (owner[i] < 0) {
+        owner[i] = client;
+        slot = i;
+        return true;
+      }
+    return false;
+  }
+  // slot, if client owns it
+  void release(size_t slot, long client) {
+    std::lock_guard<std::mutex> lock(m);
+    if (slot < owner.size() && owner[slot] == client)
+      owner[slot] = -1;
+  }
+  void release_all(long client) {
+    std::lock_guard<std::mutex> lock(m);
+    for (long &o : owner)
+      if (o == client)
+        o = -1;
+  }
+
+private:
+  std::string name;
+  uint8_t *base = nullptr;
+  size_t size = 0;
+  size_t slot_bytes = 0;
+  std::vector<long> owner; // the client per slot, -1: free
+  std::mutex m;
+};
+
+struct Connection {
+  long id;
+  int in_fd;
+  int out_fd;
+  std::mutex write_m;
+  bool open = true;    // guarded by write_m
+  bool reading = true; // these two guarded by Server::m
+  size_t queued = 0;   // requests not answered yet
+
+  Connection(long id, int in_fd, int out_fd)
+      : id(id), in_fd(in_fd), out_fd(out_fd) {}
+  ~Connection() {
+    if (in_fd > STDERR_FILENO)
+      ::close(in_fd);
+  }
+  void send(const std::string &line) {
+    std::lock_guard<std::mutex> lock(write_m);
+    if (!open)
+      return;
+    std::string out = line + "\n";
+    for (size_t done = 0; done < out.size();) {
+      ssize_t n = write(out_fd, out.data() + done, out.size() - done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        open = false; // the client is gone
+        return;
+      }
+      done += size_t(n);
+    }
+  }
+  bool is_open() {
+    std::lock_guard<std::mutex> lock(write_m);
+    return open;
+  }
+  void hang_up() {
+    std::lock_guard<std::mutex> lock(write_m);
+    open = false;
+  }
+};
+
+struct Request {
+  std::shared_ptr<Connection> client;
+  std::string tag;
+  float x, y, angle, fov;
+  size_t w, h;
+};
+
+class Server {
+public:
+  Server(const World &world, SlotPool &slots)
+      : world(world), slots(slots),
+        views(world, 2 * ThreadPool::shared().size()) {}
+
+  // splits the connection's input into lines until it ends or quits. what
+  // was asked before the end is still answered, then the client's slots
+  // are released; quitting releases them at once
+  void serve(const std::shared_ptr<Connection> &client) {
+    std::string pending;
+    char chunk[4096];
+    for (;;) {
+      size_t end;
+      while ((end = pending.find('\n')) != std::string::npos) {
+        std::string line = pending.substr(0, end);
+        pending.erase(0, end + 1);
+        if (!handle(client, line)) {
+          client->hang_up();
+          end_of_input(client);
+          return;
+        }
+      }
+      ssize_t n = read(client->in_fd, chunk, sizeof(chunk));
+      if (n < 0 && errno == EINTR && stop_signal)
+        return; // main() cleans up and exits
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      pending.append(chunk, size_t(n));
+    }
+    end_of_input(client);
+  }
+
+  // takes the requests that have arrived and have a slot and renders them
+  // at once, each frame sent as soon as it is done, until stop() and the
+  // queue is empty. a request without a slot stays queued, waiting for a
+  // release; nothing is held meanwhile, so the release can always come
+  void render_batches() {
+    ThreadPool &pool = ThreadPool::shared();
+    std::vector<Request> batch, refused;
+    std::vector<size_t> slot;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(m);
+        for (;;) {
+          if (queue.empty() && stopping)
+            return;
+          take_batch(2 * pool.size(), batch, slot, refused);
+          if (!batch.empty() || !refused.empty())
+            break;
+          cv.wait(lock); // for a request, a release or an end of input
+        }
+      }
+      pool.parallel_for(0, batch.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          const Request &r = batch[i];
+          if (slot[i] == slots.count())
+            continue;
+          try {
+            std::unique_ptr<View> view = views.take(r.w, r.h);
+            view->render(r.x, r.y, r.angle, r.fov, slots.at(slot[i]));
+            views.give_back(r.w, r.h, std::move(view));
+          } catch (const std::exception &e) {
+            // out of memory, say: this request fails, the server goes on
+            slots.release(slot[i], r.client->id);
+            r.client->send("error " + r.tag + " " + e.what());
+            continue;
+          }
+          std::ostringstream line;
+          line << "frame " << r.tag << " " << slot[i] << " "
+               << slot[i] * slots.bytes() << " " << r.w << " " << r.h;
+          r.client->send(line.str());
+        }
+      });
+      for (const Request &r : refused)
+        r.client->send("error " + r.tag + " no free slot");
+      batch.insert(batch.end(), refused.begin(), refused.end());
+      for (const Request &r : batch)
+        answered(r.client);
+      batch.clear();
+      refused.clear();
+      slot.clear();
+    }
+  }
+  void stop() {
+    std::lock_guard<std::mutex> lock(m);
+    stopping = true;
+    cv.notify_all();
+  }
+
+private:
+  const World &world;
+  SlotPool &slots;
+  ViewCache views;
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<Request> queue; // guarded by m
+  bool stopping = false;
+
+  // with m held: moves up to limit requests that have a slot now from the
+  // queue into batch, their slots into slot (count() for a client that is
+  // gone). those of clients done sending that found no slot go to refused
+  void take_batch(size_t limit, std::vector<Request> &batch,
+                  std::vector<size_t> &slot, std::vector<Request> &refused) {
+    for (auto it = queue.begin(); it != queue.end() && batch.size() < limit;) {
+      size_t s = slots.count();
+      if (it->client->is_open() && !slots.try_acquire(it->client->id, s)) {
+        if (it->client->reading) {
+          ++it;
+          continue;
+        }
+        refused.push_back(*it);
+      } else {
+        batch.push_back(*it);
+        slot.push_back(s);
+      }
+      it = queue.erase(it);
+    }
+  }
+  // one of client's requests is answered; after its last one, and the end
+  // of its input, its slots are free again
+  void answered(const std::shared_ptr<Connection> &client) {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      if (--client->queued > 0 || client->reading)
+        return;
+    }
+    release_all(client);
+  }
+  void release_all(const std::shared_ptr<Connection> &client) {
+    slots.release_all(client->id);
+    std::lock_guard<std::mutex> lock(m);
+    cv.notify_all(); // queued requests may have a slot now
+  }
+
+  // false: the client is done
+  bool handle(const std::shared_ptr<Connection> &client,
+              const std::string &line) {
+    std::istringstream in(line);
+    std::string command;
+    if (!(in >> command))
+      return true;
+    if (command == "quit")
+      return false;
+    if (command == "release") {
+      size_t slot;
+      if (in >> slot) {
+        slots.release(slot, client->id);
+        std::lock_guard<std::mutex> lock(m);
+        cv.notify_all();
+      }
+      return true;
+    }
+    Request r;
+    if (command != "render" || !(in >> r.tag)) {
+      client->send("error - unknown request");
+      return true;
+    }
+    if (!(in >> r.x >> r.y >> r.angle >> r.fov >> r.w >> r.h)) {
+      client->send("error " + r.tag + " expected X Y ANGLE FOV W H");
+      return true;
+    }
+    std::string why = check(r);
+    if (!why.empty()) {
+      client->send("error " + r.tag + " " + why);
+      return true;
+    }
+    r.client = client;
+    std::lock_guard<std::mutex> lock(m);
+    client->queued++;
+    queue.push_back(r);
+    cv.notify_all();
+    return true;
+  }
+
+  std::string check(const Request &r) const {
+    // w * h * 4 > bytes(), without the product wrapping around
+    if (r.w == 0 || r.h == 0 || r.w > slots.bytes() / 4 / r.h)
+      return "size out of range";
+    if (!(r.fov > 0 && r.fov < float(PI)))
+      return "fov out of range";
+    if (!(r.x >= 0 && r.y >= 0 && r.x < world.grid.w && r.y < world.grid.h))
+      return "outside the map";
+    if (world.grid.cells[size_t(r.x) + size_t(r.y) * world.grid.w] != '0')
+      return "inside a wall";
+    return "";
+  }
+
+  void end_of_input(const std::shared_ptr<Connection> &client) {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      client->reading = false;
+      cv.notify_all(); // its waiting requests are refused now
+      if (client->queued > 0 && client->is_open())
+        return; // released with the last answer
+    }
+    release_all(client);
+  }
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  // blocked in every thread started from here on (the pool's first of all),
+  // main() takes them back once the others are running
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+
+  std::string map_path, engine = "dda", socket_path;
+  std::string shm_name = "/trc_server." + std::to_string(getpid());
+  size_t num_slots = 2 * ThreadPool::shared().size();
+  size_t max_w = 1920, max_h = 1080;
+  auto usage = [&] {
+    std::cerr << "usage: " << argv[0]
+              << " [--map file] [--engine dda|pyramid|sdf] [--socket path]"
+              << " [--slots N] [--max-size WxH] [--shm name]" << std::endl;
+    return 1;
+  };
+  try { // std::stoul throws on values that aren't numbers
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      bool has_value = i + 1 < argc;
+      if (arg == "--map" && has_value) {
+        map_path = argv[++i];
+      } else if (arg == "--engine" && has_value) {
+        engine = argv[++i];
+      } else if (arg == "--socket" && has_value) {
+        socket_path = argv[++i];
+      } else if (arg == "--slots" && has_value) {
+        num_slots = std::max<size_t>(1, std::stoul(argv[++i]));
+      } else if (arg == "--max-size" && has_value) {
+        std::string size = argv[++i];
+        size_t x = size.find('x');
+        if (x == std::string::npos) {
+          std::cerr << "--max-size: expected WxH" << std::endl;
+          return 1;
+        }
+        max_w = std::stoul(size.substr(0, x));
+        max_h = std::stoul(size.substr(x + 1));
+      } else if (arg == "--shm" && has_value) {
+        shm_name = argv[++i];
+      } else {
+        return usage();
+      }
+    }
+  } catch (const std::exception &) {
+    return usage();
+  }
+
+  // the palette is seeded once, the same every run
+  std::mt19937 gen(0);
+  for (int i = 0; i < 256; i++)
+    ColorUtil::colors.push_back(
+        ColorUtil::pack_colors(gen() % 256, gen() % 256, gen() % 256));
+  World world;
+  MapFile map_file;
+  if (map_path.empty()) {
+    world.grid = PacketGrid(builtin_map(), 16, 16);
+  } else {
+    if (!map_file.open(map_path)) {
+      std::cerr << map_path << ": " << map_file.error() << std::endl;
+      return 1;
+    }
+    world.grid = map_file.packet_grid();
+    std::copy(map_file.palette(), map_file.palette() + map_file.palette_size(),
+              ColorUtil::colors.begin());
+  }
+  const PacketGrid &grid = world.grid;
+  if (engine == "pyramid")
+    world.pyramid.reset(new OccupancyPyramid(grid.cells, grid.w, grid.h));
+  else if (engine == "sdf" && !map_path.empty())
+    world.field.reset(new DistanceField(DistanceField::cached(
+        map_path + ".sdf", grid.cells, grid.w, grid.h)));
+  else if (engine == "sdf")
+    world.field.reset(new DistanceField(grid.cells, grid.w, grid.h));
+  world.textures = TextureAtlas::bricks(
+      ColorUtil::colors.data(),
+      std::min<size_t>(ColorUtil::colors.size(), MapFile::max_materials));
+
+  SlotPool slots;
+  if (!slots.open(shm_name, num_slots, max_w * max_h * 4)) {
+    std::cerr << shm_name << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+  struct sigaction stop = {};
+  stop.sa_handler = request_stop; // no SA_RESTART: read and accept give up
+  sigaction(SIGINT, &stop, nullptr);
+  sigaction(SIGTERM, &stop, nullptr);
+  signal(SIGPIPE, SIG_IGN); // a client that went away fails its write
+
+  Server server(world, slots);
+  std::thread renderer([&] { server.render_batches(); });
+  pthread_sigmask(SIG_UNBLOCK, &stop_signals, nullptr);
+  // on a signal: what's still queued is dropped, the clients cut off
+  auto remove_and_exit = [&] {
+    slots.close();
+    if (!socket_path.empty())
+      unlink(socket_path.c_str());
+    _exit(0);
+  };
+  std::ostringstream ready;
+  ready << "ready " << shm_name << " " << slots.count() << " "
+        << slots.bytes();
+
+  if (socket_path.empty()) {
+    std::shared_ptr<Connection> client =
+        std::make_shared<Connection>(0, STDIN_FILENO, STDOUT_FILENO);
+    client->send(ready.str());
+    server.serve(client); // until stdin ends, then finish what's queued
+    if (stop_signal)
+      remove_and_exit();
+  } else {
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (listener < 0 || socket_path.size() >= sizeof(addr.sun_path)) {
+      std::cerr << socket_path << ": can't create the socket" << std::endl;
+      return 1;
+    }
+    memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    unlink(socket_path.c_str());
+    if (bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, 16) != 0) {
+      std::cerr << socket_path << ": " << strerror(errno) << std::endl;
+      return 1;
+    }
+    std::cout << ready.str() << std::endl;
+    for (long id = 1; !stop_signal; id++) { // until killed
+      int fd = accept(listener, nullptr, nullptr);
+      if (fd < 0)
+        continue;
+      std::shared_ptr<Connection> client =
+          std::make_shared<Connection>(id, fd, fd);
+      client->send(ready.str());
+      pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr); // for the thread
+      std::thread([&server, client] { server.serve(client); }).detach();
+      pthread_sigmask(SIG_UNBLOCK, &stop_signals, nullptr);
+    }
+    remove_and_exit();
+  }
+  server.stop();
+  renderer.join();
+  return 0;
+}
+
+#else
+int main() {
+  std::cerr << "trc_server needs POSIX shared memory and sockets" << std::endl;
+  return 1;
+}
+#endif
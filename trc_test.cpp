@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "map_file.h"
+#include "trc.h"
+
+// trc_test: checks that run under ctest; prints what failed, exits 1 if
+// anything did
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cerr << "FAILED: " << what << std::endl;
+    failures++;
+  }
+}
+
+std::vector<char> read_file(const std::string &filename) {
+  std::ifstream in(filename, std::ios::binary);
+  return std::vector<char>(std::istreambuf_iterator<char>(in),
+                           std::istreambuf_iterator<char>());
+}
+
+// a whole-frame encoder between two to_ppm() calls must leave the regions
+// it saw change to the ppm: move one player, to_qoi/to_png, move the other,
+// to_ppm, and the ppm has to match the pixels
+void full_frame_encoders_keep_dirty_regions() {
+  for (std::string format : {"qoi", "png"}) {
+    Screen screen(256, 128);
+    PacketGrid grid(builtin_map(), 16, 16);
+    Window window1(&screen, 0, 0, 128, 128);
+    Window window2(&screen, 128, 0, 128, 128);
+    Player player1(&screen, 3.5, 2.5, 0.3);
+    Player player2(&screen, 10.5, 9.5, 2.0);
+    LocalMiniMap minimap1(window1, grid, &player1);
+    LocalMiniMap minimap2(window2, grid, &player2);
+    player1.minimap = &minimap1;
+    player2.minimap = &minimap2;
+
+    screen.render();
+    screen.to_ppm("trc_test.ppm");
+    player1.walk(0.05, 0.3);
+    screen.render();
+    if (format == "qoi")
+      screen.to_qoi("trc_test.qoi");
+    else
+      screen.to_png("trc_test.png");
+    player2.walk(0.05, -0.3);
+    screen.render();
+    screen.to_ppm("trc_test.ppm");
+
+    write_ppm("trc_test_fresh.ppm", screen.pixels, screen.layout);
+    check(read_file("trc_test.ppm") == read_file("trc_test_fresh.ppm"),
+          "to_ppm after to_" + format + " misses a region");
+  }
+}
+
+// map files are checked cell by cell, and sizes that would wrap around
+// are rejected instead of read past
+void map_files_are_checked() {
+  const std::string path = "trc_test.map";
+  check(save_map(path, builtin_map(), 16, 16, ColorUtil::colors.data(), 16),
+        "save_map");
+  MapFile map;
+  check(map.open(path), "open a saved map: " + map.error());
+  map.close();
+
+  std::vector<char> file = read_file(path);
+  MapFileHeader header;
+  memcpy(&header, file.data(), sizeof(header));
+  for (char bad : {'/', char('0' + MapFile::max_materials)}) {
+    std::vector<char> broken = file;
+    broken[header.cells_offset + 17] = bad;
+    std::ofstream(path, std::ios::binary).write(broken.data(), broken.size());
+    check(!map.open(path), "a cell of " + std::to_string(int((unsigned char)bad)) + " accepted");
+  }
+  // cells_offset + w * h + tail wraps around to a small number
+  MapFileHeader wrapped = header;
+  wrapped.cells_offset = uint64_t(0) - 64;
+  std::vector<char> broken = file;
+  memcpy(broken.data(), &wrapped, sizeof(wrapped));
+  std::ofstream(path, std::ios::binary).write(broken.data(), broken.size());
+  check(!map.open(path), "dimensions that wrap around accepted");
+}
+
+// any change to a player is seen by render(), however small: the frame
+// after each change equals one rendered from scratch
+void changed_players_are_rendered() {
+  PacketGrid grid(builtin_map(), 16, 16);
+  Screen screen(128, 128), fresh(128, 128);
+  Window window(&screen, 0, 0, 128, 128), fresh_window(&fresh, 0, 0, 128, 128);
+  Player player(&screen, 3.5, 2.5, 0.3), fresh_player(&fresh, 3.5, 2.5, 0.3);
+  LocalMiniMap minimap(window, grid, &player);
+  LocalMiniMap fresh_minimap(fresh_window, grid, &fresh_player);
+  player.minimap = &minimap;
+  fresh_player.minimap = &fresh_minimap;
+  screen.render();
+  for (int step = 0; step < 64; step++) {
+    // a bit of the angle at a time, now and then back where it was
+    player.a = step % 8 == 7 ? 0.3f : std::nextafter(player.a, 10.0f);
+    player.x += step % 3 == 0 ? 0.25f : 0.0f;
+    screen.render();
+    fresh_player.x = player.x;
+    fresh_player.a = player.a;
+    fresh.invalidate();
+    fresh.render();
+    if (!std::equal(screen.pixels, screen.pixels + screen.layout.size(),
+                    fresh.pixels)) {
+      check(false, "a frame after a change was not rendered again");
+      return;
+    }
+  }
+}
+
+} // namespace
+
+int main() {
+  for (int i = 0; i < 256; i++)
+    ColorUtil::colors.push_back(
+        ColorUtil::pack_colors(i, 255 - i, (i * 37) % 256));
+
+  full_frame_encoders_keep_dirty_regions();
+  map_files_are_checked();
+  changed_players_are_rendered();
+
+  if (failures)
+    std::cerr << failures << " check(s) failed" << std::endl;
+  return failures ? 1 : 0;
+}